@@ -0,0 +1,51 @@
+//===- BufferAccesses.h - Buffers accessed by lowered Pony ops ---*- C++ -*-===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the analysis of the buffers read and written by the
+// operations of a lowered Pony function, used to decide which loop nests may
+// be reordered with respect to each other.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MLIR_TUTORIAL_PONY_BUFFERACCESSES_H_
+#define MLIR_TUTORIAL_PONY_BUFFERACCESSES_H_
+
+#include "mlir/IR/Operation.h"
+#include "llvm/ADT/DenseSet.h"
+
+namespace mlir {
+namespace pony {
+
+/// Return the buffer that the given memref is a view of, or the memref itself.
+Value getRootBuffer(Value memRef);
+
+/// The buffers read and written by an operation and all the operations nested
+/// in it.
+struct BufferAccesses {
+  llvm::SmallDenseSet<Value, 4> reads;
+  llvm::SmallDenseSet<Value, 4> writes;
+  /// Set when some effects can't be attributed to a buffer, e.g. for calls.
+  /// The operation then conflicts with every other one.
+  bool unknown = false;
+
+  /// Return true if the operations must not be reordered.
+  bool conflictsWith(const BufferAccesses &other) const {
+    if (unknown || other.unknown)
+      return true;
+    for (Value buffer : writes)
+      if (other.reads.count(buffer) || other.writes.count(buffer))
+        return true;
+    return llvm::any_of(reads,
+                        [&](Value buffer) { return other.writes.count(buffer); });
+  }
+};
+
+/// Collect the buffers accessed by the given operation, views being resolved
+/// to the buffer they alias. Allocations and deallocations count as writes.
+BufferAccesses getBufferAccesses(Operation *op);
+
+} // namespace pony
+} // namespace mlir
+
+#endif // MLIR_TUTORIAL_PONY_BUFFERACCESSES_H_
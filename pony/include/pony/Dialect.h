@@ -9,6 +9,7 @@
 #ifndef MLIR_TUTORIAL_PONY_DIALECT_H_
 #define MLIR_TUTORIAL_PONY_DIALECT_H_
 
+#include "mlir/Dialect/Arithmetic/IR/Arithmetic.h"
 #include "mlir/IR/BuiltinTypes.h"
 #include "mlir/IR/Dialect.h"
 #include "mlir/IR/FunctionInterfaces.h"
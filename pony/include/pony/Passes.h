@@ -17,13 +17,94 @@ class Pass;
 namespace pony {
 std::unique_ptr<Pass> createShapeInferencePass();
 
+/// Create a pass specializing every generic function for the shapes of the
+/// arguments it is called with, starting from `main`.
+std::unique_ptr<mlir::Pass> createFunctionSpecializationPass();
+
+/// Create a pass marking the functions whose inlining at all of their call
+/// sites would grow the code by more than `threshold` lowered operations, so
+/// that the inliner keeps them out of line.
+std::unique_ptr<mlir::Pass> createInlineCostModelPass(unsigned threshold);
+
+/// Create a pass reassociating the chains of matrix products in the order
+/// performing the fewest floating point operations.
+std::unique_ptr<mlir::Pass> createMatrixChainReorderingPass();
+
+/// Create a pass fusing the trees of elementwise operations into
+/// `pony.fused_elementwise` operations.
+std::unique_ptr<mlir::Pass> createElementwiseFusionPass();
+
+/// Tuning parameters of the lowering of Pony operations to affine loops.
+struct AffineLoweringOptions {
+  /// Depth of the panels of the GEMM reduction dimension. A panel of the right
+  /// hand side operand is reused across rows, and should fit in L1.
+  unsigned gemmL1TileSize = 128;
+  /// Number of rows and columns of the blocks of the GEMM result. The operand
+  /// panels read by a block should fit in L2.
+  unsigned gemmL2TileSize = 256;
+  /// Lower the GEMM, elementwise and transpose operations to loops over
+  /// `vector` values instead of scalars.
+  bool vectorize = false;
+  /// Number of elements in the vectors, which should fill a SIMD register.
+  unsigned vectorWidth = 4;
+  /// Number of threads expected to run the parallel loops. The loops are all
+  /// kept sequential when it is 1.
+  unsigned numThreads = 1;
+  /// Minimum number of scalar operations performed by a loop nest for it to
+  /// be worth running in parallel.
+  unsigned parallelGrainSize = 16384;
+  /// Store the result of elementwise operations into the buffer of an operand
+  /// that has no other use, instead of a new buffer.
+  bool inPlace = true;
+  /// Maximum size in bytes of the statically shaped buffers allocated on the
+  /// stack instead of the heap, 0 disabling stack allocation.
+  unsigned stackAllocThreshold = 1024;
+};
+
 /// Create a pass for lowering to operations in the `Affine` and `Std` dialects,
 /// for a subset of the Pony IR (e.g. matmul).
-std::unique_ptr<mlir::Pass> createLowerToAffinePass();
+std::unique_ptr<mlir::Pass>
+createLowerToAffinePass(const AffineLoweringOptions &options = {});
+
+/// Create a pass shrinking the lifetime of the buffers of the lowered functions
+/// to their uses, and reusing the dead buffers for later allocations.
+std::unique_ptr<mlir::Pass> createBufferPlanningPass();
+
+/// Create a pass fusing the sibling affine loop nests that iterate over the
+/// same space and read common buffers.
+std::unique_ptr<mlir::Pass> createHorizontalFusionPass();
+
+/// Create a pass vectorizing by `vectorWidth`, with the affine
+/// super-vectorizer, the scalar loop nests that only access buffers with an
+/// identity layout.
+std::unique_ptr<mlir::Pass> createAffineVectorizationPass(unsigned vectorWidth);
+
+/// Create a pass unrolling-and-jamming by `factor` the parallel loops of the
+/// lowered functions that only hold an innermost loop.
+std::unique_ptr<mlir::Pass> createAffineUnrollJamPass(unsigned factor);
+
+/// Create a pass running the independent loop nests of the lowered functions
+/// concurrently, as `async.execute` regions.
+std::unique_ptr<mlir::Pass> createAsyncExecutionPass();
+
+/// Format in which `pony.print` writes arrays.
+enum class PrintFormat {
+  /// Every element formatted as with `printf("%f ")`, and a newline after
+  /// every row of the inner dimensions.
+  Text,
+  /// The rank and the dimensions as 64-bit integers, followed by the raw f64
+  /// elements in row-major order.
+  Binary,
+};
 
 /// Create a pass for lowering operations the remaining `Pony` operations, as
 /// well as `Affine` and `Std`, to the LLVM dialect for codegen.
-std::unique_ptr<mlir::Pass> createLowerToLLVMPass();
+std::unique_ptr<mlir::Pass>
+createLowerToLLVMPass(PrintFormat printFormat = PrintFormat::Text);
+
+/// Register the Pony passes, so that they can be used in textual pass
+/// pipelines.
+void registerPonyPasses();
 
 } // namespace pony
 } // namespace mlir
@@ -0,0 +1,48 @@
+//===- Runtime.h - Runtime support library of Pony programs -----*- C++ -*-===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the functions of the runtime library that compiled Pony
+// programs call into. They follow the C interface of MLIR functions carrying
+// the `llvm.emit_c_interface` attribute, i.e. memrefs are passed as pointers
+// to their descriptors.
+//
+// The arrays are printed to the standard output, or to the file named by the
+// `PONY_PRINT_FILE` environment variable when it is set.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MLIR_TUTORIAL_PONY_RUNTIME_H_
+#define MLIR_TUTORIAL_PONY_RUNTIME_H_
+
+#include "mlir/ExecutionEngine/CRunnerUtils.h"
+
+#ifdef _WIN32
+#ifdef pony_runtime_EXPORTS
+#define PONY_RUNTIME_EXPORT __declspec(dllexport)
+#else
+#define PONY_RUNTIME_EXPORT __declspec(dllimport)
+#endif
+#else
+#define PONY_RUNTIME_EXPORT __attribute__((visibility("default")))
+#endif
+
+/// Print the elements of the given array to the standard output as `pony.print`
+/// does: every element is followed by a space, and every row of every inner
+/// dimension by a newline. The output matches calling `printf("%f ")` on each
+/// element, but is formatted in a buffer written at once.
+extern "C" PONY_RUNTIME_EXPORT void
+_mlir_ciface_ponyPrintMemrefF64(UnrankedMemRefType<double> *input);
+
+/// Write the given array to the standard output in the binary format of
+/// `pony.print`: the rank and the dimensions as 64-bit integers, followed by
+/// the f64 elements in row-major order, all in the byte order of the host.
+extern "C" PONY_RUNTIME_EXPORT void
+_mlir_ciface_ponyPrintMemrefBinaryF64(UnrankedMemRefType<double> *input);
+
+/// Print a row-major array of the given rank and dimensions in the text format
+/// of `pony.print`, e.g. to convert the binary output back to text.
+extern "C" PONY_RUNTIME_EXPORT void
+ponyPrintArrayF64(int64_t rank, const int64_t *sizes, const double *data);
+
+#endif // MLIR_TUTORIAL_PONY_RUNTIME_H_
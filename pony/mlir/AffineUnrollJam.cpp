@@ -0,0 +1,97 @@
+//===- AffineUnrollJam.cpp - Unroll-and-jam of Pony loop nests ------------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass unrolling-and-jamming the loops
+// of a lowered Pony function right above the innermost ones. The copies of the
+// innermost body then share the loads of the elements that don't depend on the
+// unrolled loop, and expose independent operations to the scheduler. Unlike
+// the upstream pass, which only considers a function starting with a loop,
+// every top-level nest is visited.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Dialect/Affine/Analysis/AffineAnalysis.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/LoopUtils.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/Passes.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "affine-unroll-jam"
+
+using namespace mlir;
+
+/// Return true if the body of the given loop only holds an innermost loop.
+static bool holdsSingleInnermostLoop(AffineForOp loop) {
+  Block *body = loop.getBody();
+  auto inner = dyn_cast<AffineForOp>(body->front());
+  if (!inner || inner->getNextNode() != body->getTerminator())
+    return false;
+  WalkResult result = inner.getBody()->walk([](AffineForOp) {
+    return WalkResult::interrupt();
+  });
+  return !result.wasInterrupted();
+}
+
+namespace {
+/// The AffineUnrollJamPass visits the top-level loop nests of a function, and
+/// unrolls-and-jams by `factor` the loops that:
+///
+///   1) Only hold an innermost loop, whose bounds don't depend on them.
+///   2) Are parallel, so that interleaving their iterations is always legal.
+///
+/// The iterations left over when the trip count is not a multiple of `factor`
+/// run in a cleanup loop.
+class AffineUnrollJamPass
+    : public mlir::PassWrapper<AffineUnrollJamPass,
+                               OperationPass<mlir::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-affine-unroll-jam"; }
+  StringRef getDescription() const final {
+    return "Unroll-and-jam the parallel loops around the innermost loops";
+  }
+
+  AffineUnrollJamPass() = default;
+  AffineUnrollJamPass(const AffineUnrollJamPass &pass) : PassWrapper(pass) {}
+  AffineUnrollJamPass(unsigned factor) { this->factor = factor; }
+
+  void runOnOperation() override {
+    mlir::FuncOp f = getOperation();
+    if (f.isExternal() || factor < 2)
+      return;
+
+    SmallVector<AffineForOp, 8> loops;
+    for (auto nest : f.getBody().front().getOps<AffineForOp>())
+      nest.walk([&](AffineForOp loop) {
+        if (holdsSingleInnermostLoop(loop) && isLoopParallel(loop))
+          loops.push_back(loop);
+      });
+
+    for (AffineForOp loop : loops) {
+      if (failed(loopUnrollJamByFactor(loop, factor)))
+        continue;
+      LLVM_DEBUG(llvm::dbgs() << "'" << f.getName()
+                              << "': unrolled-and-jammed a loop by " << factor
+                              << "\n");
+      ++numJammedLoops;
+    }
+  }
+
+private:
+  Option<unsigned> factor{*this, "factor",
+                          llvm::cl::desc("Unroll-and-jam factor"),
+                          llvm::cl::init(4)};
+
+  Statistic numJammedLoops{this, "num-jammed-loops",
+                           "Number of loops unrolled-and-jammed"};
+};
+} // namespace
+
+/// Create an Affine Unroll Jam pass.
+std::unique_ptr<mlir::Pass>
+mlir::pony::createAffineUnrollJamPass(unsigned factor) {
+  return std::make_unique<AffineUnrollJamPass>(factor);
+}
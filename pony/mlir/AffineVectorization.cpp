@@ -0,0 +1,115 @@
+//===- AffineVectorization.cpp - Super-vectorization of Pony loop nests ---===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass vectorizing the scalar loop
+// nests of a lowered Pony function with the affine super-vectorizer. Unlike
+// the upstream pass, which visits every loop, it only considers the nests
+// accessing buffers with an identity layout: the super-vectorizer rejects the
+// strided views of transposes with errors, and the nests already vectorized by
+// the lowering must not be vectorized again.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Dialect/Affine/Analysis/AffineAnalysis.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/Utils.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/Passes.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "affine-vectorization"
+
+using namespace mlir;
+
+/// Return true if the given loop nest only computes on scalars, and only
+/// accesses buffers with an identity layout.
+static bool isVectorizableNest(AffineForOp nest) {
+  WalkResult result = nest.walk([](Operation *op) {
+    auto isUnsupported = [](Type type) {
+      if (type.isa<VectorType>())
+        return true;
+      auto memRefType = type.dyn_cast<MemRefType>();
+      return memRefType && !memRefType.getLayout().isIdentity();
+    };
+    if (llvm::any_of(op->getOperandTypes(), isUnsupported) ||
+        llvm::any_of(op->getResultTypes(), isUnsupported))
+      return WalkResult::interrupt();
+    return WalkResult::advance();
+  });
+  return !result.wasInterrupted();
+}
+
+namespace {
+/// The AffineVectorizationPass visits the top-level loop nests of a function:
+///
+///   1) A nest is skipped if it accesses a buffer with a non-identity layout,
+///      e.g. the strided view of a transpose, or if it already computes on
+///      vectors.
+///   2) The parallel loops of the other nests are given to the
+///      super-vectorizer, which vectorizes the innermost ones by `vectorWidth`
+///      when their accesses are contiguous or invariant.
+///
+/// The vector transfers created may broadcast invariant elements, or read
+/// along a dimension other than the innermost one. They are lowered to scalar
+/// loops before the conversion to LLVM.
+class AffineVectorizationPass
+    : public mlir::PassWrapper<AffineVectorizationPass,
+                               OperationPass<mlir::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-affine-vectorization"; }
+  StringRef getDescription() const final {
+    return "Super-vectorize the scalar loop nests of contiguous buffers";
+  }
+
+  AffineVectorizationPass() = default;
+  AffineVectorizationPass(const AffineVectorizationPass &pass)
+      : PassWrapper(pass) {}
+  AffineVectorizationPass(unsigned vectorWidth) {
+    this->vectorWidth = vectorWidth;
+  }
+
+  void runOnOperation() override {
+    mlir::FuncOp f = getOperation();
+    if (f.isExternal() || vectorWidth < 2)
+      return;
+
+    llvm::DenseSet<Operation *> parallelLoops;
+    for (auto nest : f.getBody().front().getOps<AffineForOp>()) {
+      if (!isVectorizableNest(nest)) {
+        ++numSkippedNests;
+        continue;
+      }
+      nest.walk([&](AffineForOp loop) {
+        if (isLoopParallel(loop))
+          parallelLoops.insert(loop);
+      });
+    }
+    if (parallelLoops.empty())
+      return;
+
+    LLVM_DEBUG(llvm::dbgs() << "'" << f.getName() << "': vectorizing among "
+                            << parallelLoops.size() << " parallel loops\n");
+    vectorizeAffineLoops(f, parallelLoops, {int64_t(vectorWidth)},
+                         /*fastestVaryingPattern=*/{});
+  }
+
+private:
+  Option<unsigned> vectorWidth{
+      *this, "vector-width",
+      llvm::cl::desc("Number of elements in the vectors"), llvm::cl::init(4)};
+
+  Statistic numSkippedNests{
+      this, "num-skipped-nests",
+      "Number of loop nests left to the lowering or with strided accesses"};
+};
+} // namespace
+
+/// Create an Affine Vectorization pass.
+std::unique_ptr<mlir::Pass>
+mlir::pony::createAffineVectorizationPass(unsigned vectorWidth) {
+  return std::make_unique<AffineVectorizationPass>(vectorWidth);
+}
@@ -0,0 +1,127 @@
+//===- AsyncExecution.cpp - Concurrent execution of lowered Pony ops ------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass running the independent loop
+// nests of a lowered Pony function concurrently. Every nest is wrapped in an
+// `async.execute` region depending on the tokens of the nests it conflicts
+// with, which turns the function into a dataflow graph of tasks.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Dialect/Async/IR/Async.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Interfaces/LoopLikeInterface.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/BufferAccesses.h"
+#include "pony/Passes.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "async-execution"
+
+using namespace mlir;
+using namespace pony;
+
+namespace {
+/// The AsyncExecutionPass walks the top-level operations of a function in
+/// order, tracking the loop nests launched and not awaited yet:
+///
+///   1) A loop nest is moved into an `async.execute` region, depending on the
+///      tokens of the pending nests it conflicts with (read after write, write
+///      after read or write after write on the same buffer, views being
+///      resolved to the buffer they alias).
+///   2) Any other operation still runs in order on the calling thread: it
+///      first awaits the pending nests it conflicts with, e.g. a dealloc waits
+///      for the nests using the buffer and a call waits for every nest.
+///   3) The terminator awaits all the pending nests.
+///
+/// Function arguments are assumed not to alias each other, which holds for
+/// the destination-passing style of the lowering. Functions whose nests form
+/// a chain, each depending on the previous one, are left unchanged as they
+/// would only pay for the task overhead.
+class AsyncExecutionPass
+    : public mlir::PassWrapper<AsyncExecutionPass,
+                               OperationPass<mlir::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-async-execution"; }
+  StringRef getDescription() const final {
+    return "Run the independent loop nests of the functions concurrently";
+  }
+
+  void getDependentDialects(DialectRegistry &registry) const override {
+    registry.insert<async::AsyncDialect>();
+  }
+
+  void runOnOperation() override {
+    mlir::FuncOp f = getOperation();
+    if (f.isExternal())
+      return;
+    Block &body = f.getBody().front();
+
+    if (!hasIndependentNests(body))
+      return;
+
+    // The tokens of the nests launched and not awaited yet, with the buffers
+    // they access.
+    SmallVector<std::pair<Value, BufferAccesses>, 8> pending;
+    OpBuilder builder(&getContext());
+    for (Operation &op : llvm::make_early_inc_range(body)) {
+      BufferAccesses accesses = getBufferAccesses(&op);
+      builder.setInsertionPoint(&op);
+
+      if (isa<LoopLikeOpInterface>(op) && !accesses.unknown) {
+        SmallVector<Value, 4> dependencies;
+        for (auto &launched : pending)
+          if (launched.second.conflictsWith(accesses))
+            dependencies.push_back(launched.first);
+
+        Operation *yield = nullptr;
+        auto execute = builder.create<async::ExecuteOp>(
+            op.getLoc(), TypeRange(), dependencies, ValueRange(),
+            [&](OpBuilder &nestedBuilder, Location loc, ValueRange) {
+              yield = nestedBuilder.create<async::YieldOp>(loc, ValueRange());
+            });
+        op.moveBefore(yield);
+        LLVM_DEBUG(llvm::dbgs() << "Launching a nest with "
+                                << dependencies.size() << " dependencies\n");
+        pending.emplace_back(execute->getResult(0), std::move(accesses));
+        ++numAsyncNests;
+        continue;
+      }
+
+      bool isTerminator = op.hasTrait<OpTrait::IsTerminator>();
+      llvm::erase_if(pending, [&](auto &launched) {
+        if (!isTerminator && !launched.second.conflictsWith(accesses))
+          return false;
+        builder.create<async::AwaitOp>(op.getLoc(), launched.first);
+        return true;
+      });
+    }
+  }
+
+private:
+  /// Return true if some loop nest of the block does not conflict with the
+  /// one preceding it, so that they could run concurrently.
+  static bool hasIndependentNests(Block &body) {
+    Optional<BufferAccesses> previous;
+    for (Operation &op : body) {
+      if (!isa<LoopLikeOpInterface>(op))
+        continue;
+      BufferAccesses accesses = getBufferAccesses(&op);
+      if (previous && !previous->conflictsWith(accesses))
+        return true;
+      previous = std::move(accesses);
+    }
+    return false;
+  }
+
+  Statistic numAsyncNests{this, "num-async-nests",
+                          "Number of loop nests run as async tasks"};
+};
+} // namespace
+
+/// Create an Async Execution pass.
+std::unique_ptr<mlir::Pass> mlir::pony::createAsyncExecutionPass() {
+  return std::make_unique<AsyncExecutionPass>();
+}
@@ -0,0 +1,59 @@
+//===- BufferAccesses.cpp - Buffers accessed by lowered Pony ops ----------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the analysis of the buffers read and written by the
+// operations of a lowered Pony function.
+//
+//===----------------------------------------------------------------------===//
+
+#include "pony/BufferAccesses.h"
+#include "mlir/Dialect/MemRef/IR/MemRef.h"
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+#include "mlir/Interfaces/ViewLikeInterface.h"
+
+using namespace mlir;
+
+Value mlir::pony::getRootBuffer(Value memRef) {
+  while (Operation *def = memRef.getDefiningOp()) {
+    if (auto view = dyn_cast<ViewLikeOpInterface>(def))
+      memRef = view.getViewSource();
+    else if (isa<memref::TransposeOp>(def))
+      memRef = def->getOperand(0);
+    else
+      break;
+  }
+  return memRef;
+}
+
+pony::BufferAccesses mlir::pony::getBufferAccesses(Operation *op) {
+  BufferAccesses accesses;
+  op->walk([&](Operation *nested) {
+    // The effects of these operations are the ones of their nested
+    // operations, which are visited on their own.
+    if (nested->hasTrait<OpTrait::HasRecursiveSideEffects>())
+      return;
+
+    auto effectInterface = dyn_cast<MemoryEffectOpInterface>(nested);
+    if (!effectInterface) {
+      accesses.unknown = true;
+      return;
+    }
+
+    SmallVector<MemoryEffects::EffectInstance, 2> effects;
+    effectInterface.getEffects(effects);
+    for (const MemoryEffects::EffectInstance &effect : effects) {
+      Value value = effect.getValue();
+      if (!value) {
+        accesses.unknown = true;
+        continue;
+      }
+      Value buffer = getRootBuffer(value);
+      if (isa<MemoryEffects::Read>(effect.getEffect()))
+        accesses.reads.insert(buffer);
+      else
+        accesses.writes.insert(buffer);
+    }
+  });
+  return accesses;
+}
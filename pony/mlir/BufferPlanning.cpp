@@ -0,0 +1,240 @@
+//===- BufferPlanning.cpp - Liveness based planning of Pony buffers -------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass planning the buffers allocated by
+// the affine lowering of Pony. The lowering allocates every buffer at the top
+// of the function and frees it at the end, so that all intermediate arrays
+// are live at once. This pass shrinks the lifetime of each buffer to its uses,
+// and reuses the buffers that are dead for the later allocations that fit in.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Dialect/MemRef/IR/MemRef.h"
+#include "mlir/Interfaces/ViewLikeInterface.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/Passes.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "buffer-planning"
+
+using namespace mlir;
+
+namespace {
+/// A buffer allocated at the top level of a function, with its lifetime
+/// expressed as the positions of its first and last uses in the block.
+struct PlannedBuffer {
+  memref::AllocOp alloc;
+  memref::DeallocOp dealloc;
+  unsigned firstUse;
+  unsigned lastUse;
+
+  MemRefType getType() { return alloc.getType(); }
+  int64_t getSizeInBytes() {
+    return getType().getNumElements() *
+           llvm::divideCeil(getType().getElementTypeBitWidth(), 8);
+  }
+};
+} // namespace
+
+/// Collect in `users` the operations using `memRef`, directly or through a
+/// view.
+static void collectUsers(Value memRef, SmallVectorImpl<Operation *> &users) {
+  for (Operation *user : memRef.getUsers()) {
+    users.push_back(user);
+    if (isa<ViewLikeOpInterface, memref::TransposeOp>(user))
+      for (Value view : user->getResults())
+        collectUsers(view, users);
+  }
+}
+
+namespace {
+/// The BufferPlanningPass works on the top-level operations of a function:
+///
+///   1) The lifetime of every statically shaped allocation freed in the same
+///      block is computed as the interval between the first and the last
+///      top-level operations using it, directly or through a view.
+///   2) Allocations are processed by increasing first use. A buffer whose
+///      last use precedes the first use of an allocation is dead, and is
+///      reused for it if it is large enough, the smallest one being picked.
+///      The allocation is replaced with a `memref.reinterpret_cast` of the
+///      reused buffer when their shapes differ.
+///   3) The remaining allocations are moved right before their first use, and
+///      the deallocations right after the last use of their buffer.
+///
+/// Buffers that escape the function, or that are used by the terminator, are
+/// left untouched.
+class BufferPlanningPass
+    : public mlir::PassWrapper<BufferPlanningPass,
+                               OperationPass<mlir::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-buffer-planning"; }
+  StringRef getDescription() const final {
+    return "Shrink the lifetime of the buffers and reuse the dead ones";
+  }
+
+  void runOnOperation() override {
+    mlir::FuncOp f = getOperation();
+    if (f.isExternal())
+      return;
+    Block &body = f.getBody().front();
+
+    DenseMap<Operation *, unsigned> positions;
+    for (Operation &op : body)
+      positions.try_emplace(&op, positions.size());
+
+    // Compute the lifetime of the buffers that can be planned.
+    SmallVector<PlannedBuffer, 8> buffers;
+    for (auto alloc : body.getOps<memref::AllocOp>()) {
+      if (!alloc.getType().hasStaticShape())
+        continue;
+      if (Optional<PlannedBuffer> buffer = getLifetime(alloc, body, positions))
+        buffers.push_back(*buffer);
+    }
+    llvm::stable_sort(buffers, [](const PlannedBuffer &lhs,
+                                  const PlannedBuffer &rhs) {
+      return lhs.firstUse < rhs.firstUse;
+    });
+
+    int64_t bytesBefore = 0;
+    for (PlannedBuffer &buffer : buffers)
+      bytesBefore += buffer.getSizeInBytes();
+
+    // Assign the allocations to the dead buffers that fit them. `live` holds
+    // the indices of the buffers kept, ordered by first use, and `dead` those
+    // of the kept buffers that are no longer used.
+    SmallVector<unsigned, 8> live;
+    SmallVector<unsigned, 8> dead;
+    SmallVector<std::pair<unsigned, unsigned>, 8> reuses;
+    for (unsigned i = 0, e = buffers.size(); i != e; ++i) {
+      PlannedBuffer &buffer = buffers[i];
+      llvm::erase_if(live, [&](unsigned index) {
+        if (buffers[index].lastUse >= buffer.firstUse)
+          return false;
+        dead.push_back(index);
+        return true;
+      });
+
+      Optional<unsigned> bestFit;
+      for (unsigned index : dead) {
+        MemRefType type = buffers[index].getType();
+        if (type.getElementType() != buffer.getType().getElementType() ||
+            type.getMemorySpace() != buffer.getType().getMemorySpace() ||
+            type.getNumElements() < buffer.getType().getNumElements())
+          continue;
+        if (!bestFit ||
+            type.getNumElements() < buffers[*bestFit].getType().getNumElements())
+          bestFit = index;
+      }
+
+      if (!bestFit) {
+        live.push_back(i);
+        continue;
+      }
+
+      // The reused buffer now lives until the last use of the allocation.
+      llvm::erase_value(dead, *bestFit);
+      live.push_back(*bestFit);
+      buffers[*bestFit].lastUse = buffer.lastUse;
+      reuses.emplace_back(i, *bestFit);
+    }
+
+    // Compute the peak memory with the planned lifetimes.
+    int64_t bytesAfter = 0;
+    SmallVector<int64_t, 16> liveBytes(positions.size() + 1, 0);
+    for (unsigned index : llvm::concat<unsigned>(live, dead)) {
+      PlannedBuffer &buffer = buffers[index];
+      for (unsigned pos = buffer.firstUse; pos <= buffer.lastUse; ++pos)
+        liveBytes[pos] += buffer.getSizeInBytes();
+    }
+    for (int64_t bytes : liveBytes)
+      bytesAfter = std::max(bytesAfter, bytes);
+    LLVM_DEBUG(llvm::dbgs() << "'" << f.getName() << "': peak memory of "
+                            << bytesBefore << " bytes reduced to "
+                            << bytesAfter << " bytes\n");
+    peakBytesBefore += bytesBefore;
+    peakBytesAfter += bytesAfter;
+
+    // Rewrite the reused allocations as views of the buffers they reuse.
+    SmallVector<Operation *, 16> opsByPosition(positions.size());
+    for (auto &it : positions)
+      opsByPosition[it.second] = it.first;
+    OpBuilder builder(&getContext());
+    for (auto &reuse : reuses) {
+      PlannedBuffer &buffer = buffers[reuse.first];
+      PlannedBuffer &reused = buffers[reuse.second];
+      Value replacement = reused.alloc;
+      if (reused.getType() != buffer.getType()) {
+        builder.setInsertionPoint(opsByPosition[buffer.firstUse]);
+        replacement = createView(builder, buffer.alloc.getLoc(), reused.alloc,
+                                 buffer.getType());
+      }
+      buffer.dealloc.erase();
+      buffer.alloc.replaceAllUsesWith(replacement);
+      buffer.alloc.erase();
+      ++numReusedBuffers;
+    }
+
+    // Shrink the lifetime of the buffers kept to their uses.
+    for (unsigned index : llvm::concat<unsigned>(live, dead)) {
+      PlannedBuffer &buffer = buffers[index];
+      buffer.alloc->moveBefore(opsByPosition[buffer.firstUse]);
+      buffer.dealloc->moveAfter(opsByPosition[buffer.lastUse]);
+    }
+  }
+
+private:
+  /// Return the lifetime of the given allocation, or None if it can't be
+  /// planned.
+  static Optional<PlannedBuffer>
+  getLifetime(memref::AllocOp alloc, Block &body,
+              const DenseMap<Operation *, unsigned> &positions) {
+    SmallVector<Operation *, 8> users;
+    collectUsers(alloc, users);
+
+    PlannedBuffer buffer{alloc, memref::DeallocOp(), ~0u, 0};
+    for (Operation *user : users) {
+      if (auto dealloc = dyn_cast<memref::DeallocOp>(user)) {
+        if (dealloc->getBlock() != &body || buffer.dealloc)
+          return llvm::None;
+        buffer.dealloc = dealloc;
+        continue;
+      }
+      Operation *ancestor = body.findAncestorOpInBlock(*user);
+      if (!ancestor || ancestor->hasTrait<OpTrait::IsTerminator>())
+        return llvm::None;
+      unsigned position = positions.lookup(ancestor);
+      buffer.firstUse = std::min(buffer.firstUse, position);
+      buffer.lastUse = std::max(buffer.lastUse, position);
+    }
+    if (!buffer.dealloc || buffer.firstUse > buffer.lastUse)
+      return llvm::None;
+    return buffer;
+  }
+
+  /// Create a view of `source` with the given contiguous type.
+  static Value createView(OpBuilder &builder, Location loc, Value source,
+                          MemRefType type) {
+    SmallVector<int64_t, 4> strides(type.getRank(), 1);
+    for (int64_t dim = type.getRank() - 1; dim > 0; --dim)
+      strides[dim - 1] = strides[dim] * type.getDimSize(dim);
+    return builder.create<memref::ReinterpretCastOp>(
+        loc, type, source, /*offset=*/0, type.getShape(), strides);
+  }
+
+  Statistic numReusedBuffers{this, "num-reused-buffers",
+                             "Number of allocations reusing a dead buffer"};
+  Statistic peakBytesBefore{this, "peak-bytes-before",
+                            "Peak memory of the buffers before planning"};
+  Statistic peakBytesAfter{this, "peak-bytes-after",
+                           "Peak memory of the buffers after planning"};
+};
+} // namespace
+
+/// Create a Buffer Planning pass.
+std::unique_ptr<mlir::Pass> mlir::pony::createBufferPlanningPass() {
+  return std::make_unique<BufferPlanningPass>();
+}
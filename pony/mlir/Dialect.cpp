@@ -32,10 +32,11 @@ struct PonyInlinerInterface : public DialectInlinerInterface {
   // Analysis Hooks
   //===--------------------------------------------------------------------===//
 
-  /// All call operations within pony can be inlined.
+  /// Call operations within pony can be inlined, unless the inlining cost
+  /// model decided to keep the callee out of line.
   bool isLegalToInline(Operation *call, Operation *callable,
                        bool wouldBeCloned) const final {
-    return true;
+    return !callable->hasAttr(PonyDialect::getNoInlineAttrName());
   }
 
   /// All operations within pony can be inlined.
@@ -98,13 +99,15 @@ void PonyDialect::initialize() {
 //===----------------------------------------------------------------------===//
 
 /// A generalized parser for binary operations. This parses the different forms
-/// of 'printBinaryOp' below.
+/// of 'printBinaryOp' below. Operations taking more operands than the two of a
+/// binary operation pass a `requiredOperandCount` of -1.
 static mlir::ParseResult parseBinaryOp(mlir::OpAsmParser &parser,
-                                       mlir::OperationState &result) {
+                                       mlir::OperationState &result,
+                                       int requiredOperandCount = 2) {
   SmallVector<mlir::OpAsmParser::UnresolvedOperand, 2> operands;
   SMLoc operandsLoc = parser.getCurrentLocation();
   Type type;
-  if (parser.parseOperandList(operands, /*requiredOperandCount=*/2) ||
+  if (parser.parseOperandList(operands, requiredOperandCount) ||
       parser.parseOptionalAttrDict(result.attributes) ||
       parser.parseColonType(type))
     return mlir::failure();
@@ -259,6 +262,36 @@ bool CastOp::areCastCompatible(TypeRange inputs, TypeRange outputs) {
   return !input.hasRank() || !output.hasRank() || input == output;
 }
 
+//===----------------------------------------------------------------------===//
+// FusedElementwiseOp
+//===----------------------------------------------------------------------===//
+
+/// Infer the output shape of the FusedElementwiseOp, this is required by the
+/// shape inference interface.
+void FusedElementwiseOp::inferShapes() {
+  getResult().setType(getOperand(0).getType());
+}
+
+mlir::LogicalResult FusedElementwiseOp::verify() {
+  if (getInputs().empty())
+    return emitOpError() << "expects at least one input";
+
+  // The body takes the element of each input as a scalar.
+  Block &body = getBody().front();
+  if (body.getNumArguments() != getInputs().size())
+    return emitOpError() << "expects the body to take " << getInputs().size()
+                         << " arguments, one per input, got "
+                         << body.getNumArguments();
+  for (auto it : llvm::zip(body.getArgumentTypes(), getInputs().getTypes())) {
+    Type elementType = std::get<1>(it).cast<TensorType>().getElementType();
+    if (std::get<0>(it) != elementType)
+      return emitOpError() << "expects the body arguments to be the element "
+                              "types of the inputs, got "
+                           << std::get<0>(it) << " for " << elementType;
+  }
+  return mlir::success();
+}
+
 //===----------------------------------------------------------------------===//
 // FuncOp
 //===----------------------------------------------------------------------===//
@@ -357,7 +390,8 @@ void GemmOp::build(mlir::OpBuilder &builder, mlir::OperationState &state,
 
 mlir::ParseResult GemmOp::parse(mlir::OpAsmParser &parser,
                                 mlir::OperationState &result) {
-  return parseBinaryOp(parser, result);
+  // The epilogue operands follow the two operands of the product.
+  return parseBinaryOp(parser, result, /*requiredOperandCount=*/-1);
 }
 
 void GemmOp::print(mlir::OpAsmPrinter &p) { printBinaryOp(p, *this); }
@@ -370,12 +404,35 @@ void GemmOp::inferShapes() {
   auto rhsShape = rhsTy.getShape();
   auto elementType = lhsTy.getElementType();
 
-  std::vector<int64_t> resultShape = {lhsShape[0], rhsShape[1]};
+  // The rows of the result are the ones of `lhs`, or its columns when it is
+  // transposed, and similarly for the columns of the result with `rhs`.
+  std::vector<int64_t> resultShape = {lhsShape[getTransposeLhs() ? 1 : 0],
+                                      rhsShape[getTransposeRhs() ? 0 : 1]};
   auto resultType = RankedTensorType::get(resultShape, elementType);
   getResult().setType(resultType);  
 
 }
 
+mlir::LogicalResult GemmOp::verify() {
+  // Every epilogue operation applies to the next epilogue operand.
+  ArrayAttr epilogue = getEpilogueAttr();
+  size_t numEpilogueOps = epilogue ? epilogue.size() : 0;
+  if (numEpilogueOps != getEpilogueOperands().size())
+    return emitOpError() << "expects one epilogue operand per epilogue "
+                            "operation, got "
+                         << getEpilogueOperands().size() << " operands for "
+                         << numEpilogueOps << " operations";
+  if (epilogue) {
+    for (Attribute kind : epilogue) {
+      StringRef name = kind.cast<StringAttr>().getValue();
+      if (name != "add" && name != "mul")
+        return emitOpError() << "unknown epilogue operation '" << name
+                             << "', expected 'add' or 'mul'";
+    }
+  }
+  return mlir::success();
+}
+
 //===----------------------------------------------------------------------===//
 // ReturnOp
 //===----------------------------------------------------------------------===//
@@ -0,0 +1,186 @@
+//===- ElementwiseFusion.cpp - Fusion of Pony elementwise operations ------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass fusing the trees of Pony
+// elementwise operations into `pony.fused_elementwise` operations. Every
+// element of the result of a tree is then computed at once from the elements
+// of its inputs, instead of materializing each intermediate array in memory.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Pass/Pass.h"
+#include "pony/Dialect.h"
+#include "pony/Passes.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <functional>
+
+#define DEBUG_TYPE "elementwise-fusion"
+
+using namespace mlir;
+using namespace pony;
+
+/// Return the value of all the elements of `value` if it is defined by a splat
+/// `pony.constant`, or null otherwise.
+static FloatAttr getSplatConstant(Value value) {
+  auto constantOp = value.getDefiningOp<ConstantOp>();
+  if (!constantOp || !constantOp.getValue().isSplat())
+    return FloatAttr();
+  return constantOp.getValue().getSplatValue<FloatAttr>();
+}
+
+/// Collect in `producers` the elementwise operations computing the operands
+/// of `consumer` that can be fused into it, and recursively their own
+/// producers, parents first. A producer is fused when its result has the
+/// given type and no other use, as it doesn't need to be materialized then.
+static void collectProducers(Operation *consumer, Type type,
+                             SmallVectorImpl<Operation *> &producers) {
+  for (Value operand : consumer->getOperands()) {
+    Operation *producer = operand.getDefiningOp();
+    if (!isa_and_nonnull<AddOp, MulOp>(producer) || !operand.hasOneUse() ||
+        operand.getType() != type)
+      continue;
+    producers.push_back(producer);
+    collectProducers(producer, type, producers);
+  }
+}
+
+namespace {
+/// The ElementwiseFusionPass visits the elementwise operations of a function
+/// from the last one, so that the root of every tree is visited before its
+/// producers:
+///
+///   1) The tree rooted at the operation is collected (see collectProducers).
+///   2) The values used by the tree and not computed by it become the inputs
+///      of a `pony.fused_elementwise`, splat constants apart.
+///   3) Its body recomputes the tree on scalars: `pony.add` and `pony.mul`
+///      become `arith.addf` and `arith.mulf`, and the splat constants become
+///      `arith.constant`.
+///   4) The root is replaced by the fused operation, and the tree is erased.
+///
+/// The pass expects the shapes to be inferred, so that the operations of a
+/// tree can be checked to have the same shape.
+class ElementwiseFusionPass
+    : public mlir::PassWrapper<ElementwiseFusionPass,
+                               OperationPass<pony::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-elementwise-fusion"; }
+  StringRef getDescription() const final {
+    return "Fuse the trees of Pony elementwise operations";
+  }
+
+  void runOnOperation() override {
+    SmallVector<Operation *, 16> elementwiseOps;
+    getOperation().walk([&](Operation *op) {
+      if (isa<AddOp, MulOp>(op))
+        elementwiseOps.push_back(op);
+    });
+
+    llvm::DenseSet<Operation *> fusedOps;
+    for (Operation *root : llvm::reverse(elementwiseOps)) {
+      if (fusedOps.count(root))
+        continue;
+      auto type = root->getResult(0).getType().dyn_cast<RankedTensorType>();
+      if (!type || !type.hasStaticShape())
+        continue;
+
+      SmallVector<Operation *, 8> producers;
+      collectProducers(root, type, producers);
+      if (producers.empty() || !fuseTree(root, producers))
+        continue;
+      fusedOps.insert(producers.begin(), producers.end());
+
+      // Each intermediate array was written once and read once.
+      ++numFusedTrees;
+      numEliminatedBuffers += producers.size();
+      savedBytes += producers.size() * 2 * type.getNumElements() *
+                    llvm::divideCeil(type.getElementTypeBitWidth(), 8);
+    }
+  }
+
+private:
+  /// Replace the tree made of `root` and its `producers` with a single
+  /// `pony.fused_elementwise` operation. Return false if the tree is left
+  /// unchanged.
+  static bool fuseTree(Operation *root, ArrayRef<Operation *> producers) {
+    llvm::SmallPtrSet<Operation *, 8> tree(producers.begin(), producers.end());
+    tree.insert(root);
+    Location loc = root->getLoc();
+
+    // The inputs are the values used by the tree, and not computed by it.
+    SmallVector<Value, 4> inputs;
+    DenseMap<Value, unsigned> inputIndices;
+    std::function<void(Operation *)> collectInputs = [&](Operation *op) {
+      for (Value operand : op->getOperands()) {
+        Operation *producer = operand.getDefiningOp();
+        if (producer && tree.count(producer))
+          collectInputs(producer);
+        else if (!getSplatConstant(operand) &&
+                 inputIndices.try_emplace(operand, inputs.size()).second)
+          inputs.push_back(operand);
+      }
+    };
+    collectInputs(root);
+
+    // The fused operation takes its shape from its inputs, trees of splat
+    // constants are left to the lowering of the elementwise operations.
+    if (inputs.empty())
+      return false;
+
+    OpBuilder builder(root);
+    auto fusedOp = builder.create<FusedElementwiseOp>(
+        loc, root->getResult(0).getType(), inputs);
+    SmallVector<Type, 4> argTypes;
+    for (Value input : inputs)
+      argTypes.push_back(input.getType().cast<TensorType>().getElementType());
+    SmallVector<Location, 4> argLocs(inputs.size(), loc);
+    Block *body = builder.createBlock(&fusedOp.getBody(), {}, argTypes,
+                                      argLocs);
+
+    // Recompute the tree on the elements of the inputs.
+    std::function<Value(Value)> buildElement = [&](Value value) -> Value {
+      Operation *op = value.getDefiningOp();
+      if (!op || !tree.count(op)) {
+        if (FloatAttr splat = getSplatConstant(value))
+          return builder.create<arith::ConstantOp>(loc, splat);
+        return body->getArgument(inputIndices.lookup(value));
+      }
+      Value lhs = buildElement(op->getOperand(0));
+      Value rhs = buildElement(op->getOperand(1));
+      if (isa<MulOp>(op))
+        return builder.create<arith::MulFOp>(op->getLoc(), lhs, rhs);
+      return builder.create<arith::AddFOp>(op->getLoc(), lhs, rhs);
+    };
+    builder.create<YieldOp>(loc, buildElement(root->getResult(0)));
+
+    LLVM_DEBUG(llvm::dbgs() << "Fused " << producers.size() + 1
+                            << " operations with " << inputs.size()
+                            << " inputs\n");
+
+    // Erase the tree, consumers first.
+    root->getResult(0).replaceAllUsesWith(fusedOp.getResult());
+    root->erase();
+    for (Operation *producer : producers)
+      producer->erase();
+    return true;
+  }
+
+  Statistic numFusedTrees{this, "num-fused-trees",
+                          "Number of trees of elementwise operations fused"};
+  Statistic numEliminatedBuffers{
+      this, "num-eliminated-buffers",
+      "Number of intermediate arrays no longer materialized"};
+  Statistic savedBytes{this, "saved-bytes",
+                       "Bytes of memory traffic saved by not materializing "
+                       "the intermediate arrays"};
+};
+} // namespace
+
+/// Create an Elementwise Fusion pass.
+std::unique_ptr<mlir::Pass> mlir::pony::createElementwiseFusionPass() {
+  return std::make_unique<ElementwiseFusionPass>();
+}
@@ -0,0 +1,211 @@
+//===- FunctionSpecialization.cpp - Shape specialization of functions -----===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Module level pass performing interprocedural
+// propagation of array shapes by cloning every generic function once for each
+// distinct set of argument shapes it is called with. Calls can then be kept
+// out of line and lowered as real function calls instead of being inlined.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/SymbolTable.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/Dialect.h"
+#include "pony/Passes.h"
+#include "pony/ShapeInferenceInterface.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "function-specialization"
+
+using namespace mlir;
+using namespace pony;
+
+namespace {
+/// The FunctionSpecializationPass performs shape inference starting from
+/// `main`, and specializes callees on demand.
+///
+///    Algorithm:
+///
+///   1) Run the intra-procedural shape inference worklist on `main`.
+///   2) When a `pony.generic_call` has all of its operands inferred:
+///     a) look up (or create) the clone of the callee specialized for the
+///        operand types, named after the callee and the operand shapes,
+///     b) recursively infer the shapes within the clone, and record the
+///        inferred return type in its signature,
+///     c) retarget the call to the clone and take its result type.
+///   3) The generic functions are left untouched, they become dead once every
+///      call has been retargeted and can be removed with symbol DCE.
+///
+class FunctionSpecializationPass
+    : public mlir::PassWrapper<FunctionSpecializationPass,
+                               OperationPass<ModuleOp>> {
+public:
+  StringRef getArgument() const final { return "pony-function-specialization"; }
+  StringRef getDescription() const final {
+    return "Specialize the generic Pony functions for their argument shapes";
+  }
+
+  void runOnOperation() override {
+    SymbolTable symbolTable(getOperation());
+    specializations.clear();
+
+    // Modules without a `main` have no known call shapes to start from.
+    auto main = symbolTable.lookup<pony::FuncOp>("main");
+    if (!main)
+      return;
+
+    if (failed(inferFunction(main, symbolTable)))
+      signalPassFailure();
+  }
+
+private:
+  /// Infer the shapes of all the operations in the given function,
+  /// specializing the callees of the generic calls on the way. On success, the
+  /// signature of the function is updated with the inferred result type.
+  LogicalResult inferFunction(pony::FuncOp f, SymbolTable &symbolTable) {
+    // Populate the worklist with the operations that need shape inference:
+    // these are operations that return a dynamic shape.
+    llvm::SmallPtrSet<mlir::Operation *, 16> opWorklist;
+    f.walk([&](mlir::Operation *op) {
+      if (returnsDynamicShape(op))
+        opWorklist.insert(op);
+    });
+
+    // Iterate on the operations in the worklist until all operations have been
+    // inferred or no change happened (fix point).
+    while (!opWorklist.empty()) {
+      auto nextop = llvm::find_if(opWorklist, allOperandsInferred);
+      if (nextop == opWorklist.end())
+        break;
+
+      Operation *op = *nextop;
+      opWorklist.erase(op);
+
+      LLVM_DEBUG(llvm::dbgs() << "Inferring shape for: " << *op << "\n");
+      if (auto call = dyn_cast<GenericCallOp>(op)) {
+        if (failed(specializeCall(call, symbolTable)))
+          return failure();
+      } else if (auto shapeOp = dyn_cast<ShapeInference>(op)) {
+        shapeOp.inferShapes();
+      } else {
+        return op->emitError("unable to infer shape of operation without "
+                             "shape inference interface");
+      }
+    }
+
+    if (!opWorklist.empty())
+      return f.emitError("Shape inference failed, ")
+             << opWorklist.size() << " operations couldn't be inferred\n";
+
+    // The return operand now carries the specialized result type.
+    auto returnOp = cast<ReturnOp>(f.getBody().back().getTerminator());
+    f.setType(FunctionType::get(f.getContext(),
+                                f.getFunctionType().getInputs(),
+                                returnOp.getOperandTypes()));
+    return success();
+  }
+
+  /// Retarget the given call to the specialization of its callee matching the
+  /// operand types.
+  LogicalResult specializeCall(GenericCallOp call, SymbolTable &symbolTable) {
+    auto callee = symbolTable.lookup<pony::FuncOp>(call.getCallee());
+    if (!callee)
+      return call.emitError("call to unknown function '")
+             << call.getCallee() << "'";
+
+    pony::FuncOp specialized =
+        getOrCreateSpecialization(callee, call.getOperandTypes(), symbolTable);
+    if (!specialized)
+      return failure();
+
+    ArrayRef<Type> results = specialized.getFunctionType().getResults();
+    if (results.size() != 1)
+      return call.emitError("the result of a call to '")
+             << callee.getName() << "' is used, but it returns no value";
+
+    call->setAttr("callee", SymbolRefAttr::get(specialized));
+    call.getResult().setType(results.front());
+    return success();
+  }
+
+  /// Return the clone of `callee` specialized for `argTypes`, creating and
+  /// inferring it if necessary. Returns nullptr on failure.
+  pony::FuncOp getOrCreateSpecialization(pony::FuncOp callee,
+                                         TypeRange argTypes,
+                                         SymbolTable &symbolTable) {
+    // Only the clones created by this pass are reused: a user function may
+    // have the mangled name, e.g. `foo_f64`.
+    auto key = std::make_pair(
+        callee.getOperation(),
+        FunctionType::get(callee.getContext(), argTypes, TypeRange()));
+    auto existing = specializations.find(key);
+    if (existing != specializations.end())
+      return existing->second;
+
+    // Clone the generic function and give it the call operand types. The
+    // clone is registered before being inferred so that a recursive call
+    // refers to it instead of specializing endlessly.
+    pony::FuncOp clone = callee.clone();
+    clone.setName(getSpecializedName(callee.getName(), argTypes));
+    clone.setPrivate();
+    clone.setType(FunctionType::get(callee.getContext(), argTypes,
+                                    callee.getFunctionType().getResults()));
+    for (auto it : llvm::zip(clone.getArguments(), argTypes))
+      std::get<0>(it).setType(std::get<1>(it));
+    symbolTable.insert(clone);
+    specializations.try_emplace(key, clone);
+
+    LLVM_DEBUG(llvm::dbgs() << "Specializing '" << callee.getName()
+                            << "' as '" << clone.getName() << "'\n");
+    if (failed(inferFunction(clone, symbolTable)))
+      return nullptr;
+    return clone;
+  }
+
+  /// Mangle the shapes of the arguments into the name of the callee, e.g.
+  /// `multiply_transpose_2x3xf64_3x2xf64`. The symbol table renames the clone
+  /// if the name is already taken.
+  static std::string getSpecializedName(StringRef callee, TypeRange argTypes) {
+    std::string name;
+    llvm::raw_string_ostream os(name);
+    os << callee;
+    for (Type type : argTypes) {
+      auto tensorType = type.cast<RankedTensorType>();
+      os << "_";
+      for (int64_t dim : tensorType.getShape())
+        os << dim << "x";
+      os << tensorType.getElementType();
+    }
+    return os.str();
+  }
+
+  /// A utility method that returns if the given operation has all of its
+  /// operands inferred.
+  static bool allOperandsInferred(Operation *op) {
+    return llvm::all_of(op->getOperandTypes(), [](Type operandType) {
+      return operandType.isa<RankedTensorType>();
+    });
+  }
+
+  /// A utility method that returns if the given operation has a dynamically
+  /// shaped result.
+  static bool returnsDynamicShape(Operation *op) {
+    return llvm::any_of(op->getResultTypes(), [](Type resultType) {
+      return !resultType.isa<RankedTensorType>();
+    });
+  }
+
+  /// The clones created, by generic function and argument types.
+  DenseMap<std::pair<Operation *, Type>, pony::FuncOp> specializations;
+};
+} // namespace
+
+/// Create a Function Specialization pass.
+std::unique_ptr<mlir::Pass> mlir::pony::createFunctionSpecializationPass() {
+  return std::make_unique<FunctionSpecializationPass>();
+}
@@ -0,0 +1,192 @@
+//===- HorizontalFusion.cpp - Fusion of sibling Pony loop nests -----------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass fusing the sibling loop nests of
+// a lowered Pony function that read the same buffers. When several operations
+// consume the same array, e.g. `a * b`, `a + c` and `transpose(a)`, each of
+// their nests streams `a` from memory on its own. Once fused into a single
+// nest computing several outputs, every element of `a` is loaded once for all
+// of them.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/LoopUtils.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/IR/Dominance.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/BufferAccesses.h"
+#include "pony/Passes.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "horizontal-fusion"
+
+using namespace mlir;
+using namespace pony;
+
+/// Collect in `band` the perfectly nested loops rooted at `root`. Return false
+/// if one of them has non-constant bounds or carries values, as the iteration
+/// space of the nest can't be compared then.
+static bool getConstantBand(AffineForOp root,
+                            SmallVectorImpl<AffineForOp> &band) {
+  getPerfectlyNestedLoops(band, root);
+  return llvm::all_of(band, [](AffineForOp loop) {
+    return loop.hasConstantBounds() && loop.getNumIterOperands() == 0;
+  });
+}
+
+/// Return true if the given bands iterate over the same space.
+static bool haveSameIterationSpace(ArrayRef<AffineForOp> lhs,
+                                   ArrayRef<AffineForOp> rhs) {
+  if (lhs.size() != rhs.size())
+    return false;
+  for (auto it : llvm::zip(lhs, rhs)) {
+    AffineForOp lhsLoop = std::get<0>(it), rhsLoop = std::get<1>(it);
+    if (lhsLoop.getConstantLowerBound() != rhsLoop.getConstantLowerBound() ||
+        lhsLoop.getConstantUpperBound() != rhsLoop.getConstantUpperBound() ||
+        lhsLoop.getStep() != rhsLoop.getStep())
+      return false;
+  }
+  return true;
+}
+
+/// Return the size in bytes of the given buffer, or 0 if it is not statically
+/// shaped.
+static int64_t getSizeInBytes(Value buffer) {
+  auto type = buffer.getType().dyn_cast<MemRefType>();
+  if (!type || !type.hasStaticShape())
+    return 0;
+  return type.getNumElements() *
+         llvm::divideCeil(type.getElementTypeBitWidth(), 8);
+}
+
+namespace {
+/// The HorizontalFusionPass visits the top-level loop nests of a function in
+/// order. Every later nest `sibling` is fused into the visited nest `nest`
+/// when:
+///
+///   1) Their bands of perfectly nested loops have the same constant bounds
+///      and steps.
+///   2) They read at least one common buffer, views being resolved to the
+///      buffer they alias, and neither writes a buffer accessed by the other,
+///      so that their iterations can be interleaved in any order.
+///   3) `sibling` can be hoisted right after `nest`: it doesn't conflict with
+///      the operations in between, and the values it uses are all defined
+///      before `nest`.
+///
+/// The body of `sibling` is then moved at the end of the innermost loop of
+/// `nest`, its induction variables being replaced with the ones of `nest`.
+/// Nests lowered to `affine.parallel` are left unchanged.
+class HorizontalFusionPass
+    : public mlir::PassWrapper<HorizontalFusionPass,
+                               OperationPass<mlir::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-horizontal-fusion"; }
+  StringRef getDescription() const final {
+    return "Fuse the sibling loop nests reading common buffers";
+  }
+
+  void runOnOperation() override {
+    mlir::FuncOp f = getOperation();
+    if (f.isExternal())
+      return;
+    Block &body = f.getBody().front();
+    DominanceInfo &domInfo = getAnalysis<DominanceInfo>();
+
+    SmallVector<AffineForOp, 8> nests(body.getOps<AffineForOp>());
+    for (unsigned i = 0, e = nests.size(); i != e; ++i) {
+      SmallVector<AffineForOp, 4> band;
+      if (!nests[i] || !getConstantBand(nests[i], band))
+        continue;
+      BufferAccesses accesses = getBufferAccesses(nests[i]);
+      if (accesses.unknown)
+        continue;
+
+      for (unsigned j = i + 1; j != e; ++j) {
+        SmallVector<AffineForOp, 4> siblingBand;
+        if (!nests[j] || !getConstantBand(nests[j], siblingBand) ||
+            !haveSameIterationSpace(band, siblingBand))
+          continue;
+        BufferAccesses siblingAccesses = getBufferAccesses(nests[j]);
+        if (accesses.conflictsWith(siblingAccesses))
+          continue;
+
+        int64_t sharedBytes = 0;
+        bool sharesInputs = false;
+        for (Value buffer : siblingAccesses.reads) {
+          if (!accesses.reads.count(buffer))
+            continue;
+          sharesInputs = true;
+          sharedBytes += getSizeInBytes(buffer);
+        }
+        if (!sharesInputs ||
+            !canHoistAfter(nests[j], nests[i], siblingAccesses, domInfo))
+          continue;
+
+        LLVM_DEBUG(llvm::dbgs() << "Fusing a nest of depth " << band.size()
+                                << " sharing " << sharedBytes
+                                << " bytes of inputs\n");
+        fuseInto(siblingBand, band);
+        nests[j] = nullptr;
+        accesses.reads.insert(siblingAccesses.reads.begin(),
+                              siblingAccesses.reads.end());
+        accesses.writes.insert(siblingAccesses.writes.begin(),
+                               siblingAccesses.writes.end());
+        ++numFusedNests;
+        savedBytes += sharedBytes;
+      }
+    }
+  }
+
+private:
+  /// Return true if `sibling` can be moved right after `nest`.
+  static bool canHoistAfter(AffineForOp sibling, AffineForOp nest,
+                            const BufferAccesses &siblingAccesses,
+                            DominanceInfo &domInfo) {
+    for (Operation *op = nest->getNextNode(); op != sibling.getOperation();
+         op = op->getNextNode())
+      if (getBufferAccesses(op).conflictsWith(siblingAccesses))
+        return false;
+
+    WalkResult result = sibling.walk([&](Operation *nested) {
+      for (Value operand : nested->getOperands()) {
+        Operation *owner = operand.getParentRegion()->getParentOp();
+        if (!sibling->isAncestor(owner) &&
+            !domInfo.properlyDominates(operand, nest))
+          return WalkResult::interrupt();
+      }
+      return WalkResult::advance();
+    });
+    return !result.wasInterrupted();
+  }
+
+  /// Move the body of the innermost loop of `siblingBand` at the end of the
+  /// innermost loop of `band`, and erase the sibling nest.
+  static void fuseInto(ArrayRef<AffineForOp> siblingBand,
+                       ArrayRef<AffineForOp> band) {
+    for (auto it : llvm::zip(siblingBand, band))
+      std::get<0>(it).getInductionVar().replaceAllUsesWith(
+          std::get<1>(it).getInductionVar());
+
+    Block *src = siblingBand.back().getBody();
+    Block *dest = band.back().getBody();
+    dest->getOperations().splice(Block::iterator(dest->getTerminator()),
+                                 src->getOperations(), src->begin(),
+                                 std::prev(src->end()));
+    siblingBand.front().erase();
+  }
+
+  Statistic numFusedNests{this, "num-fused-nests",
+                          "Number of loop nests fused into a sibling"};
+  Statistic savedBytes{this, "saved-bytes",
+                       "Bytes of input traffic saved by reading the shared "
+                       "buffers once"};
+};
+} // namespace
+
+/// Create a Horizontal Fusion pass.
+std::unique_ptr<mlir::Pass> mlir::pony::createHorizontalFusionPass() {
+  return std::make_unique<HorizontalFusionPass>();
+}
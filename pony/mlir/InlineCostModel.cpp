@@ -0,0 +1,105 @@
+//===- InlineCostModel.cpp - Inlining heuristic for Pony functions --------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Module level pass deciding which shape-specialized
+// functions should be kept out of line. The decision is recorded with a
+// `pony.noinline` attribute on the callee, that the Pony inliner interface
+// honors.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/SymbolTable.h"
+#include "mlir/Pass/Pass.h"
+#include "pony/Dialect.h"
+#include "pony/Passes.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "inline-cost-model"
+
+using namespace mlir;
+using namespace pony;
+
+/// Return the approximate code size of the given operation once lowered:
+/// every Pony operation turns into about one loop nest, except for GEMM whose
+/// tiled nest is several times larger.
+static unsigned getLoweredSize(Operation *op) {
+  if (isa<ReturnOp>(op))
+    return 0;
+  if (isa<GemmOp>(op))
+    return 4;
+  return 1;
+}
+
+namespace {
+/// The InlineCostModelPass estimates, for every function, the code growth
+/// caused by inlining it at all of its call sites:
+///
+///    growth = size(callee) * (number of call sites - 1)
+///
+/// Functions called once are always inlined, as that removes the out of line
+/// copy. Others are kept out of line when their growth exceeds the threshold,
+/// so that large bodies called many times share a single compiled copy.
+/// Callees are expected to have been specialized, so that the call sites of
+/// every shape specialization are counted separately.
+class InlineCostModelPass
+    : public mlir::PassWrapper<InlineCostModelPass, OperationPass<ModuleOp>> {
+public:
+  StringRef getArgument() const final { return "pony-inline-cost-model"; }
+  StringRef getDescription() const final {
+    return "Keep the functions costly to inline everywhere out of line";
+  }
+
+  InlineCostModelPass() = default;
+  InlineCostModelPass(const InlineCostModelPass &pass) : PassWrapper(pass) {}
+  InlineCostModelPass(unsigned threshold) { this->threshold = threshold; }
+
+  void runOnOperation() override {
+    ModuleOp module = getOperation();
+    StringRef noInlineAttrName = PonyDialect::getNoInlineAttrName();
+
+    for (auto f : module.getOps<pony::FuncOp>()) {
+      Optional<SymbolTable::UseRange> uses =
+          SymbolTable::getSymbolUses(f, module);
+      if (!uses)
+        continue;
+      size_t numCalls = std::distance(uses->begin(), uses->end());
+
+      unsigned size = 0;
+      f.walk([&](Operation *op) {
+        if (op != f.getOperation())
+          size += getLoweredSize(op);
+      });
+
+      uint64_t growth = numCalls > 1 ? uint64_t(size) * (numCalls - 1) : 0;
+      LLVM_DEBUG(llvm::dbgs() << "'" << f.getName() << "': size " << size
+                              << ", " << numCalls << " calls, growth "
+                              << growth << "\n");
+      if (growth > threshold) {
+        f->setAttr(noInlineAttrName, UnitAttr::get(&getContext()));
+        ++numOutOfLine;
+      } else {
+        f->removeAttr(noInlineAttrName);
+      }
+    }
+  }
+
+private:
+  Option<unsigned> threshold{
+      *this, "threshold",
+      llvm::cl::desc("Maximum code growth, in lowered operations, accepted "
+                     "to inline a function at all of its call sites"),
+      llvm::cl::init(64)};
+
+  Statistic numOutOfLine{this, "num-out-of-line",
+                         "Number of functions kept out of line"};
+};
+} // namespace
+
+/// Create an Inline Cost Model pass.
+std::unique_ptr<mlir::Pass>
+mlir::pony::createInlineCostModelPass(unsigned threshold) {
+  return std::make_unique<InlineCostModelPass>(threshold);
+}
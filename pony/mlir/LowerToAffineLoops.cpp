@@ -4,21 +4,34 @@
 //
 // This file implements a partial lowering of Pony operations to a combination of
 // affine loops, memref operations and standard operations. This lowering
-// expects that all calls have been inlined, and all shapes have been resolved.
-//
+// expects that all shapes have been resolved. Functions that were not inlined
+// must have been specialized for the shapes of their arguments, they are
+// lowered using destination-passing style: the result buffer is allocated by
+// the caller and passed as a trailing memref argument. When vectorization is
+// enabled, the innermost loops of the GEMM and elementwise operations process
+// `vector` dialect values as wide as the SIMD registers of the target. When
+// several threads are available, the outer independent loops of large nests
+// are emitted as `affine.parallel`. Small buffers are allocated on the stack.
+// Transpose and reshape don't move any element, they are lowered to views of
+// their input buffer.
 //===----------------------------------------------------------------------===//
 
 #include "mlir/IR/BuiltinDialect.h"
 #include "pony/Dialect.h"
 #include "pony/Passes.h"
 
+#include "mlir/Dialect/Affine/Analysis/LoopAnalysis.h"
 #include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/LoopUtils.h"
 #include "mlir/Dialect/Arithmetic/IR/Arithmetic.h"
 #include "mlir/Dialect/Func/IR/FuncOps.h"
 #include "mlir/Dialect/MemRef/IR/MemRef.h"
+#include "mlir/Dialect/Vector/IR/VectorOps.h"
+#include "mlir/IR/BlockAndValueMapping.h"
+#include "mlir/IR/Matchers.h"
 #include "mlir/Pass/Pass.h"
 #include "mlir/Transforms/DialectConversion.h"
-#include "llvm/ADT/Sequence.h"
+#include "llvm/Support/xxhash.h"
 
 using namespace mlir;
 
@@ -32,9 +45,28 @@ static MemRefType convertTensorToMemRef(TensorType type) {
   return MemRefType::get(type.getShape(), type.getElementType());
 }
 
-/// Insert an allocation and deallocation for the given MemRefType.
+/// Return true if a buffer of the given type is small enough to be allocated
+/// on the stack.
+static bool isStackAllocated(MemRefType type,
+                             const pony::AffineLoweringOptions &options) {
+  return options.stackAllocThreshold != 0 && type.hasStaticShape() &&
+         type.getNumElements() *
+                 llvm::divideCeil(type.getElementTypeBitWidth(), 8) <=
+             options.stackAllocThreshold;
+}
+
+/// Insert an allocation and deallocation for the given MemRefType. Small
+/// buffers are allocated on the stack of the function instead, and need no
+/// deallocation.
 static Value insertAllocAndDealloc(MemRefType type, Location loc,
-                                   PatternRewriter &rewriter) {
+                                   PatternRewriter &rewriter,
+                                   const pony::AffineLoweringOptions &options) {
+  if (isStackAllocated(type, options)) {
+    auto alloca = rewriter.create<memref::AllocaOp>(loc, type);
+    alloca->moveBefore(&alloca->getBlock()->front());
+    return alloca;
+  }
+
   auto alloc = rewriter.create<memref::AllocOp>(loc, type);
 
   // Make sure to allocate at the beginning of the block.
@@ -48,6 +80,162 @@ static Value insertAllocAndDealloc(MemRefType type, Location loc,
   return alloc;
 }
 
+/// Copy the content of the memref `source` into the memref `dest` of the same
+/// shape, using a nest of affine loops.
+static void insertCopy(Value source, Value dest, Location loc,
+                       PatternRewriter &rewriter) {
+  auto shape = dest.getType().cast<MemRefType>().getShape();
+  SmallVector<int64_t, 4> lowerBounds(shape.size(), /*Value=*/0);
+  SmallVector<int64_t, 4> steps(shape.size(), /*Value=*/1);
+  buildAffineLoopNest(
+      rewriter, loc, lowerBounds, shape, steps,
+      [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+        auto element = nestedBuilder.create<AffineLoadOp>(loc, source, ivs);
+        nestedBuilder.create<AffineStoreOp>(loc, element, dest, ivs);
+      });
+}
+
+/// Return the given memref if it is laid out contiguously, or a copy of it into
+/// a new contiguous buffer otherwise, e.g. for a transposed view.
+static Value getContiguousBuffer(Value memRef, Location loc,
+                                 PatternRewriter &rewriter,
+                                 const pony::AffineLoweringOptions &options) {
+  auto memRefType = memRef.getType().cast<MemRefType>();
+  if (memRefType.getLayout().isIdentity())
+    return memRef;
+
+  auto contiguousType =
+      MemRefType::get(memRefType.getShape(), memRefType.getElementType());
+  Value alloc = insertAllocAndDealloc(contiguousType, loc, rewriter, options);
+  insertCopy(memRef, alloc, loc, rewriter);
+  return alloc;
+}
+
+/// Return a view of the given memref with its dimensions reversed. Only the
+/// strides of the layout are permuted.
+static Value buildTransposedView(OpBuilder &builder, Location loc,
+                                 Value memRef) {
+  SmallVector<unsigned, 4> permutation;
+  for (int64_t dim = memRef.getType().cast<MemRefType>().getRank() - 1;
+       dim >= 0; --dim)
+    permutation.push_back(dim);
+  AffineMap permutationMap =
+      AffineMap::getPermutationMap(permutation, builder.getContext());
+  return builder.create<memref::TransposeOp>(
+      loc, memRef, AffineMapAttr::get(permutationMap));
+}
+
+/// Return the number of outermost loops of a nest to run in parallel, given
+/// the trip counts of the loops that may run in parallel (outermost first) and
+/// the total number of scalar operations `work` performed by the nest. Nests
+/// doing less than two grains of work are not worth waking up the threads and
+/// stay sequential. Otherwise, loops are added until there are enough
+/// parallel iterations to feed every thread.
+static unsigned getNumParallelLoops(const pony::AffineLoweringOptions &options,
+                                    ArrayRef<int64_t> tripCounts,
+                                    int64_t work) {
+  if (options.numThreads <= 1 ||
+      work < 2 * int64_t(options.parallelGrainSize))
+    return 0;
+
+  int64_t parallelIterations = 1;
+  unsigned numParallelLoops = 0;
+  for (int64_t tripCount : tripCounts) {
+    if (parallelIterations >= options.numThreads || tripCount <= 1)
+      break;
+    parallelIterations *= tripCount;
+    ++numParallelLoops;
+  }
+  return numParallelLoops;
+}
+
+/// Build a loop nest as buildAffineLoopNest does, except that the outermost
+/// loops are folded into a single `affine.parallel` when running them on
+/// several threads is worth it (see getNumParallelLoops). Only the first
+/// `maxParallelLoops` loops, which must carry no dependence, are considered.
+static void buildParallelizableLoopNest(
+    OpBuilder &builder, Location loc, ArrayRef<int64_t> lowerBounds,
+    ArrayRef<int64_t> upperBounds, ArrayRef<int64_t> steps,
+    unsigned maxParallelLoops, int64_t work,
+    const pony::AffineLoweringOptions &options,
+    function_ref<void(OpBuilder &, Location, ValueRange)> buildBody) {
+  SmallVector<int64_t, 4> tripCounts;
+  for (unsigned i = 0, e = std::min<size_t>(maxParallelLoops, steps.size());
+       i < e; ++i)
+    tripCounts.push_back(
+        llvm::divideCeil(upperBounds[i] - lowerBounds[i], steps[i]));
+  unsigned numParallelLoops = getNumParallelLoops(options, tripCounts, work);
+  if (numParallelLoops == 0) {
+    buildAffineLoopNest(builder, loc, lowerBounds, upperBounds, steps,
+                        buildBody);
+    return;
+  }
+
+  MLIRContext *ctx = builder.getContext();
+  SmallVector<AffineMap, 4> lbMaps, ubMaps;
+  for (unsigned i = 0; i < numParallelLoops; ++i) {
+    lbMaps.push_back(AffineMap::getConstantMap(lowerBounds[i], ctx));
+    ubMaps.push_back(AffineMap::getConstantMap(upperBounds[i], ctx));
+  }
+  auto parallelOp = builder.create<AffineParallelOp>(
+      loc, TypeRange(), ArrayRef<arith::AtomicRMWKind>(), lbMaps, ValueRange(),
+      ubMaps, ValueRange(), steps.take_front(numParallelLoops));
+
+  // The remaining loops are built sequentially within the parallel loop.
+  OpBuilder::InsertionGuard guard(builder);
+  builder.setInsertionPoint(parallelOp.getBody()->getTerminator());
+  SmallVector<Value, 4> parallelIvs(parallelOp.getIVs());
+  buildAffineLoopNest(
+      builder, loc, lowerBounds.drop_front(numParallelLoops),
+      upperBounds.drop_front(numParallelLoops),
+      steps.drop_front(numParallelLoops),
+      [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+        SmallVector<Value, 4> allIvs(parallelIvs);
+        allIvs.append(ivs.begin(), ivs.end());
+        buildBody(nestedBuilder, loc, allIvs);
+      });
+}
+
+/// Store `value` to every element of the memref `dest`.
+static void insertFill(Value value, Value dest, Location loc,
+                       PatternRewriter &rewriter,
+                       const pony::AffineLoweringOptions &options) {
+  auto memRefType = dest.getType().cast<MemRefType>();
+  SmallVector<int64_t, 4> lowerBounds(memRefType.getRank(), /*Value=*/0);
+  SmallVector<int64_t, 4> steps(memRefType.getRank(), /*Value=*/1);
+  buildParallelizableLoopNest(
+      rewriter, loc, lowerBounds, memRefType.getShape(), steps,
+      memRefType.getRank(), memRefType.getNumElements(), options,
+      [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+        nestedBuilder.create<AffineStoreOp>(loc, value, dest, ivs);
+      });
+}
+
+/// Return the value of all the elements of `value` if it is defined by a splat
+/// `pony.constant`, or null otherwise.
+static FloatAttr getSplatConstant(Value value) {
+  auto constantOp = value.getDefiningOp<pony::ConstantOp>();
+  if (!constantOp || !constantOp.getValue().isSplat())
+    return FloatAttr();
+  return constantOp.getValue().getSplatValue<FloatAttr>();
+}
+
+/// Return true if the given use of a splat constant takes it as a scalar,
+/// without reading its buffer.
+static bool usesSplatsAsScalars(OpOperand &use) {
+  Operation *op = use.getOwner();
+  if (isa<pony::GemmOp>(op))
+    return use.getOperandNumber() >= 2;
+  return isa<pony::AddOp, pony::MulOp>(op);
+}
+
+/// Return true if the given constant is a splat only used as a scalar. It is
+/// then left to its users, which broadcast its value themselves.
+static bool isScalarSplat(pony::ConstantOp op) {
+  return op.getValue().isSplat() &&
+         llvm::all_of(op->getUses(), usesSplatsAsScalars);
+}
+
 /// This defines the function type used to process an iteration of a lowered
 /// loop. It takes as input an OpBuilder, an range of memRefOperands
 /// corresponding to the operands of the input operation, and the range of loop
@@ -56,24 +244,52 @@ static Value insertAllocAndDealloc(MemRefType type, Location loc,
 using LoopIterationFn = function_ref<Value(
     OpBuilder &rewriter, ValueRange memRefOperands, ValueRange loopIvs)>;
 
+/// Return the buffer of an operand of the given elementwise operation that can
+/// be overwritten with its result, or null if there is none. This is the case
+/// when the operand dies at the operation, i.e. it has no other use, and its
+/// buffer was allocated for it with the type of the result: arguments and
+/// views are never overwritten.
+static Value getInPlaceDestination(Operation *op, ValueRange operands) {
+  auto memRefType =
+      convertTensorToMemRef((*op->result_type_begin()).cast<TensorType>());
+  for (auto it : llvm::zip(op->getOperands(), operands)) {
+    Value operand = std::get<0>(it);
+    Value memRef = std::get<1>(it);
+    if (operand.hasOneUse() && memRef.getType() == memRefType &&
+        isa_and_nonnull<memref::AllocOp, memref::AllocaOp>(
+            memRef.getDefiningOp()))
+      return memRef;
+  }
+  return Value();
+}
+
+/// Lower the given operation to a nest of affine loops computing each element
+/// of its result with `processIteration`. The result is stored into `dest`
+/// when given, otherwise into a new buffer.
 static void lowerOpToLoops(Operation *op, ValueRange operands,
                            PatternRewriter &rewriter,
-                           LoopIterationFn processIteration) {
+                           const pony::AffineLoweringOptions &options,
+                           LoopIterationFn processIteration,
+                           Value dest = Value()) {
   auto tensorType = (*op->result_type_begin()).cast<TensorType>();
   auto loc = op->getLoc();
 
-  // Insert an allocation and deallocation for the result of this operation.
+  // Insert an allocation and deallocation for the result of this operation,
+  // unless it reuses a buffer.
   auto memRefType = convertTensorToMemRef(tensorType);
-  auto alloc = insertAllocAndDealloc(memRefType, loc, rewriter);
+  Value alloc =
+      dest ? dest : insertAllocAndDealloc(memRefType, loc, rewriter, options);
 
   // Create a nest of affine loops, with one loop per dimension of the shape.
   // The buildAffineLoopNest function takes a callback that is used to construct
   // the body of the innermost loop given a builder, a location and a range of
-  // loop induction variables.
+  // loop induction variables. Every element is computed independently, so any
+  // of the loops may run in parallel.
   SmallVector<int64_t, 4> lowerBounds(tensorType.getRank(), /*Value=*/0);
   SmallVector<int64_t, 4> steps(tensorType.getRank(), /*Value=*/1);
-  buildAffineLoopNest(
+  buildParallelizableLoopNest(
       rewriter, loc, lowerBounds, tensorType.getShape(), steps,
+      tensorType.getRank(), tensorType.getNumElements(), options,
       [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
         // Call the processing function with the rewriter, the memref operands,
         // and the loop induction variables. This function will return the value
@@ -86,6 +302,168 @@ static void lowerOpToLoops(Operation *op, ValueRange operands,
   rewriter.replaceOp(op, alloc);
 }
 
+/// Size of the block of the GEMM result held by the micro-kernel.
+static constexpr int64_t kGemmRegisterRows = 4;
+static constexpr int64_t kGemmRegisterCols = 4;
+
+/// Number of vectors along each row of the block of the GEMM result held by
+/// the vectorized micro-kernel.
+static constexpr int64_t kGemmVectorsPerRow = 2;
+
+/// Round `value` up to the next multiple of `multiple`.
+static int64_t roundUp(int64_t value, int64_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+/// Return the 2-d map (d0, d1) -> (d0 + rowOffset, d1 + colOffset).
+static AffineMap getOffsetMap(MLIRContext *ctx, int64_t rowOffset,
+                              int64_t colOffset) {
+  AffineExpr d0, d1;
+  bindDims(ctx, d0, d1);
+  return AffineMap::get(2, 0, {d0 + rowOffset, d1 + colOffset}, ctx);
+}
+
+/// This defines the function type used to build the body of a loop. It takes
+/// as input an OpBuilder, a location and the induction variable of the loop.
+using LoopBodyFn = function_ref<void(OpBuilder &, Location, Value)>;
+
+/// Return the upper bound map of a loop walking the tile that starts at d0:
+/// (d0) -> min(d0 + tileSize, upperBound).
+static AffineMap getTileUpperBoundMap(MLIRContext *ctx, int64_t tileSize,
+                                      int64_t upperBound) {
+  AffineExpr d0 = getAffineDimExpr(0, ctx);
+  return AffineMap::get(
+      1, 0, {d0 + tileSize, getAffineConstantExpr(upperBound, ctx)}, ctx);
+}
+
+/// Build an affine loop walking the tile that starts at `tileStart`, that is
+/// from `tileStart` to min(`tileStart` + `tileSize`, `upperBound`) by `step`.
+static void buildTileLoop(OpBuilder &builder, Location loc, Value tileStart,
+                          int64_t tileSize, int64_t upperBound, int64_t step,
+                          LoopBodyFn buildBody) {
+  MLIRContext *ctx = builder.getContext();
+  AffineMap lbMap = AffineMap::getMultiDimIdentityMap(1, ctx);
+  AffineMap ubMap = getTileUpperBoundMap(ctx, tileSize, upperBound);
+  builder.create<AffineForOp>(
+      loc, tileStart, lbMap, tileStart, ubMap, step, llvm::None,
+      [&](OpBuilder &nestedBuilder, Location loc, Value iv, ValueRange) {
+        buildBody(nestedBuilder, loc, iv);
+        nestedBuilder.create<AffineYieldOp>(loc);
+      });
+}
+
+/// Return true if the given memrefs can be accessed with vectors along their
+/// innermost dimension, i.e. they are ranked and laid out contiguously.
+static bool isVectorizable(ValueRange memRefs) {
+  return llvm::all_of(memRefs.getTypes(), [](Type type) {
+    auto memRefType = type.cast<MemRefType>();
+    return memRefType.getRank() > 0 && memRefType.getLayout().isIdentity();
+  });
+}
+
+/// Build a constant vector mask of the given width, whose first `numEnabled`
+/// lanes are set.
+static Value buildTailMask(OpBuilder &builder, Location loc, int64_t width,
+                           int64_t numEnabled) {
+  SmallVector<bool, 8> lanes(width, false);
+  std::fill_n(lanes.begin(), numEnabled, true);
+  auto maskType = VectorType::get({width}, builder.getI1Type());
+  return builder.create<arith::ConstantOp>(
+      loc, DenseElementsAttr::get(maskType, llvm::makeArrayRef(lanes)));
+}
+
+/// Load a vector of `vectorType` from `memRef` at `indices`. When a `mask` is
+/// given, only its enabled lanes are read and the others are set to the
+/// matching lanes of `passThru`.
+static Value buildVectorLoad(OpBuilder &builder, Location loc,
+                             VectorType vectorType, Value memRef,
+                             ValueRange indices, Value mask, Value passThru) {
+  if (mask)
+    return builder.create<vector::MaskedLoadOp>(loc, vectorType, memRef,
+                                                indices, mask, passThru);
+  return builder.create<AffineVectorLoadOp>(loc, vectorType, memRef, indices);
+}
+
+/// Store `value` to `memRef` at `indices`. When a `mask` is given, only its
+/// enabled lanes are written.
+static void buildVectorStore(OpBuilder &builder, Location loc, Value value,
+                             Value memRef, ValueRange indices, Value mask) {
+  if (mask)
+    builder.create<vector::MaskedStoreOp>(loc, memRef, indices, mask, value);
+  else
+    builder.create<AffineVectorStoreOp>(loc, value, memRef, indices);
+}
+
+/// This defines the function type used to process a vector of elements along
+/// the innermost dimension. It takes as input an OpBuilder, a location, the
+/// indices of the first element of the vector and the mask of its valid lanes
+/// (null when all lanes are valid). It returns the vector to store at these
+/// indices.
+using VectorIterationFn = function_ref<Value(
+    OpBuilder &builder, Location loc, ValueRange loopIvs, Value mask)>;
+
+/// Lower the given operation to a nest of affine loops whose innermost loop
+/// walks the contiguous dimension of the result `width` elements at a time.
+/// The remaining elements at the end of each row are processed with a single
+/// masked vector. The result is stored into `dest` when given, otherwise into
+/// a new buffer.
+static void lowerOpToVectorLoops(Operation *op, int64_t width,
+                                 PatternRewriter &rewriter,
+                                 const pony::AffineLoweringOptions &options,
+                                 VectorIterationFn processVector,
+                                 Value dest = Value()) {
+  auto tensorType = (*op->result_type_begin()).cast<TensorType>();
+  auto loc = op->getLoc();
+
+  // Insert an allocation and deallocation for the result of this operation,
+  // unless it reuses a buffer.
+  auto memRefType = convertTensorToMemRef(tensorType);
+  Value alloc =
+      dest ? dest : insertAllocAndDealloc(memRefType, loc, rewriter, options);
+
+  ArrayRef<int64_t> shape = memRefType.getShape();
+  int64_t rank = memRefType.getRank();
+  int64_t vectorizedCols = shape.back() - shape.back() % width;
+  int64_t tailCols = shape.back() % width;
+
+  SmallVector<int64_t, 4> lowerBounds(rank, /*Value=*/0);
+  SmallVector<int64_t, 4> upperBounds(shape.begin(), shape.end());
+  SmallVector<int64_t, 4> steps(rank, /*Value=*/1);
+  if (vectorizedCols) {
+    upperBounds.back() = vectorizedCols;
+    steps.back() = width;
+    buildParallelizableLoopNest(
+        rewriter, loc, lowerBounds, upperBounds, steps, rank,
+        memRefType.getNumElements(), options,
+        [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+          Value valueToStore = processVector(nestedBuilder, loc, ivs, Value());
+          buildVectorStore(nestedBuilder, loc, valueToStore, alloc, ivs,
+                           Value());
+        });
+  }
+
+  if (tailCols) {
+    Value mask = buildTailMask(rewriter, loc, width, tailCols);
+    Value tailStart =
+        rewriter.create<arith::ConstantIndexOp>(loc, vectorizedCols);
+    lowerBounds.pop_back();
+    upperBounds.pop_back();
+    steps.pop_back();
+    buildParallelizableLoopNest(
+        rewriter, loc, lowerBounds, upperBounds, steps, rank - 1,
+        memRefType.getNumElements() / shape.back() * tailCols, options,
+        [&](OpBuilder &nestedBuilder, Location loc, ValueRange outerIvs) {
+          SmallVector<Value, 4> ivs(outerIvs);
+          ivs.push_back(tailStart);
+          Value valueToStore = processVector(nestedBuilder, loc, ivs, mask);
+          buildVectorStore(nestedBuilder, loc, valueToStore, alloc, ivs, mask);
+        });
+  }
+
+  // Replace this operation with the generated alloc.
+  rewriter.replaceOp(op, alloc);
+}
+
 namespace {
 //===----------------------------------------------------------------------===//
 // PonyToAffine RewritePatterns: Binary operations
@@ -93,17 +471,81 @@ namespace {
 
 template <typename BinaryOp, typename LoweredBinaryOp>
 struct BinaryOpLowering : public ConversionPattern {
-  BinaryOpLowering(MLIRContext *ctx)
-      : ConversionPattern(BinaryOp::getOperationName(), 1, ctx) {}
+  BinaryOpLowering(MLIRContext *ctx, const pony::AffineLoweringOptions &options)
+      : ConversionPattern(BinaryOp::getOperationName(), 1, ctx),
+        options(options) {}
 
   LogicalResult
   matchAndRewrite(Operation *op, ArrayRef<Value> operands,
                   ConversionPatternRewriter &rewriter) const final {
     auto loc = op->getLoc();
+
+    // A splat constant operand is broadcast from a scalar instead of being
+    // loaded, its buffer is never materialized (see isScalarSplat).
+    typename BinaryOp::Adaptor originalAdaptor(op->getOperands());
+    FloatAttr lhsSplat = getSplatConstant(originalAdaptor.getLhs());
+    FloatAttr rhsSplat = getSplatConstant(originalAdaptor.getRhs());
+    FloatAttr splats[] = {lhsSplat, rhsSplat};
+    SmallVector<Value, 2> memRefOperands;
+    for (auto it : llvm::zip(operands, splats))
+      if (!std::get<1>(it))
+        memRefOperands.push_back(std::get<0>(it));
+
+    // Each element of the result only depends on the elements of the operands
+    // at the same index, so the result can overwrite a dying operand.
+    Value dest;
+    if (options.inPlace)
+      dest = getInPlaceDestination(op, operands);
+
+    if (options.vectorize && options.vectorWidth > 1 &&
+        isVectorizable(memRefOperands)) {
+      // The arithmetic operations apply lane-wise to vectors, the masked
+      // lanes of the tail are read as zeros and never stored.
+      auto vectorType = VectorType::get(
+          {options.vectorWidth},
+          op->getResultTypes().front().cast<TensorType>().getElementType());
+      Value zero = rewriter.create<arith::ConstantOp>(
+          loc, rewriter.getZeroAttr(vectorType));
+      auto getSplatVector = [&](FloatAttr splat) -> Value {
+        if (!splat)
+          return Value();
+        return rewriter.create<arith::ConstantOp>(
+            loc, DenseElementsAttr::get(vectorType, splat.getValue()));
+      };
+      Value lhsVector = getSplatVector(lhsSplat);
+      Value rhsVector = getSplatVector(rhsSplat);
+      lowerOpToVectorLoops(
+          op, options.vectorWidth, rewriter, options,
+          [&](OpBuilder &builder, Location loc, ValueRange loopIvs,
+              Value mask) -> Value {
+            typename BinaryOp::Adaptor binaryAdaptor(operands);
+            Value loadedLhs =
+                lhsVector ? lhsVector
+                          : buildVectorLoad(builder, loc, vectorType,
+                                            binaryAdaptor.getLhs(), loopIvs,
+                                            mask, zero);
+            Value loadedRhs =
+                rhsVector ? rhsVector
+                          : buildVectorLoad(builder, loc, vectorType,
+                                            binaryAdaptor.getRhs(), loopIvs,
+                                            mask, zero);
+            return builder.create<LoweredBinaryOp>(loc, loadedLhs, loadedRhs);
+          },
+          dest);
+      return success();
+    }
+
+    auto getSplatScalar = [&](FloatAttr splat) -> Value {
+      if (!splat)
+        return Value();
+      return rewriter.create<arith::ConstantOp>(loc, splat);
+    };
+    Value lhsScalar = getSplatScalar(lhsSplat);
+    Value rhsScalar = getSplatScalar(rhsSplat);
     lowerOpToLoops(
-        op, operands, rewriter,
-        [loc](OpBuilder &builder, ValueRange memRefOperands,
-              ValueRange loopIvs) {
+        op, operands, rewriter, options,
+        [&](OpBuilder &builder, ValueRange memRefOperands,
+            ValueRange loopIvs) -> Value {
           // Generate an adaptor for the remapped operands of the BinaryOp. This
           // allows for using the nice named accessors that are generated by the
           // ODS.
@@ -111,23 +553,132 @@ struct BinaryOpLowering : public ConversionPattern {
 
           // Generate loads for the element of 'lhs' and 'rhs' at the inner
           // loop.
-          auto loadedLhs = builder.create<AffineLoadOp>(
-              loc, binaryAdaptor.getLhs(), loopIvs);
-          auto loadedRhs = builder.create<AffineLoadOp>(
-              loc, binaryAdaptor.getRhs(), loopIvs);
+          Value loadedLhs =
+              lhsScalar ? lhsScalar
+                        : builder.create<AffineLoadOp>(
+                              loc, binaryAdaptor.getLhs(), loopIvs);
+          Value loadedRhs =
+              rhsScalar ? rhsScalar
+                        : builder.create<AffineLoadOp>(
+                              loc, binaryAdaptor.getRhs(), loopIvs);
 
           // Create the binary operation performed on the loaded values.
           return builder.create<LoweredBinaryOp>(loc, loadedLhs, loadedRhs);
-        });
+        },
+        dest);
     return success();
   }
+
+  pony::AffineLoweringOptions options;
 };
 using AddOpLowering = BinaryOpLowering<pony::AddOp, arith::AddFOp>;
 using MulOpLowering = BinaryOpLowering<pony::MulOp, arith::MulFOp>;
 
+//===----------------------------------------------------------------------===//
+// PonyToAffine RewritePatterns: Fused elementwise operations
+//===----------------------------------------------------------------------===//
+
+struct FusedElementwiseOpLowering : public ConversionPattern {
+  FusedElementwiseOpLowering(MLIRContext *ctx,
+                             const pony::AffineLoweringOptions &options)
+      : ConversionPattern(pony::FusedElementwiseOp::getOperationName(), 1,
+                          ctx),
+        options(options) {}
+
+  LogicalResult
+  matchAndRewrite(Operation *op, ArrayRef<Value> operands,
+                  ConversionPatternRewriter &rewriter) const final {
+    auto loc = op->getLoc();
+    Block &body = cast<pony::FusedElementwiseOp>(op).getBody().front();
+
+    // As for the binary operations, the result can overwrite a dying input.
+    Value dest;
+    if (options.inPlace)
+      dest = getInPlaceDestination(op, operands);
+
+    // The whole tree is computed in a single loop nest, by cloning the body
+    // for the elements of the inputs at each index.
+    if (options.vectorize && options.vectorWidth > 1 &&
+        isVectorizable(operands)) {
+      auto vectorType = VectorType::get(
+          {options.vectorWidth},
+          op->getResultTypes().front().cast<TensorType>().getElementType());
+      Value zero = rewriter.create<arith::ConstantOp>(
+          loc, rewriter.getZeroAttr(vectorType));
+      lowerOpToVectorLoops(
+          op, options.vectorWidth, rewriter, options,
+          [&](OpBuilder &builder, Location loc, ValueRange loopIvs,
+              Value mask) -> Value {
+            SmallVector<Value, 4> elements;
+            for (Value input : operands)
+              elements.push_back(buildVectorLoad(builder, loc, vectorType,
+                                                 input, loopIvs, mask, zero));
+            return cloneBody(builder, body, elements, vectorType);
+          },
+          dest);
+      return success();
+    }
+
+    lowerOpToLoops(
+        op, operands, rewriter, options,
+        [&](OpBuilder &builder, ValueRange memRefOperands,
+            ValueRange loopIvs) -> Value {
+          SmallVector<Value, 4> elements;
+          for (Value input : memRefOperands)
+            elements.push_back(
+                builder.create<AffineLoadOp>(loc, input, loopIvs));
+          return cloneBody(builder, body, elements, VectorType());
+        },
+        dest);
+    return success();
+  }
+
+private:
+  /// Clone the body of a fused elementwise operation for the given elements
+  /// of its inputs, and return the value it yields. When a `vectorType` is
+  /// given, the elements are vectors: the operations of the body apply
+  /// lane-wise, so only their result types change, and the constants are
+  /// splat to vectors.
+  static Value cloneBody(OpBuilder &builder, Block &body, ValueRange elements,
+                         VectorType vectorType) {
+    BlockAndValueMapping mapping;
+    mapping.map(body.getArguments(), elements);
+    for (Operation &op : body.without_terminator()) {
+      FloatAttr constant;
+      if (vectorType && matchPattern(&op, m_Constant(&constant))) {
+        mapping.map(op.getResult(0),
+                    builder.create<arith::ConstantOp>(
+                        op.getLoc(), DenseElementsAttr::get(
+                                         vectorType, constant.getValue())));
+        continue;
+      }
+      Operation *cloned = builder.clone(op, mapping);
+      if (vectorType)
+        for (Value result : cloned->getResults())
+          result.setType(vectorType);
+    }
+    return mapping.lookup(body.getTerminator()->getOperand(0));
+  }
+
+  pony::AffineLoweringOptions options;
+};
+
+//===----------------------------------------------------------------------===//
+// PonyToAffine RewritePatterns: Gemm operations
+//===----------------------------------------------------------------------===//
+
+/// An elementwise operation of the GEMM epilogue. It applies to the product
+/// and either the elements of a buffer, or a splat value held in a register.
+struct GemmEpilogueOp {
+  bool isMul;
+  Value memRef;
+  Value splat;
+};
+
 struct GemmOpLowering : public ConversionPattern {
-  GemmOpLowering(MLIRContext *ctx)
-      : ConversionPattern(pony::GemmOp::getOperationName(), 1, ctx) {}
+  GemmOpLowering(MLIRContext *ctx, const pony::AffineLoweringOptions &options)
+      : ConversionPattern(pony::GemmOp::getOperationName(), 1, ctx),
+        options(options) {}
 
   LogicalResult
   matchAndRewrite(Operation *op, ArrayRef<Value> operands,
@@ -137,47 +688,426 @@ struct GemmOpLowering : public ConversionPattern {
 
     // Insert an allocation and deallocation for the result of this operation.
     auto memRefType = convertTensorToMemRef(tensorType);
-    auto alloc = insertAllocAndDealloc(memRefType, loc, rewriter);
-
-    // Create a nest of affine loops, with one loop per dimension of the shape.
-    // The buildAffineLoopNest function takes a callback that is used to construct
-    // the body of the innermost loop given a builder, a location and a range of
-    // loop induction variables.
-    SmallVector<int64_t, 3> lowerBounds(3, /*Value=*/0);
-    SmallVector<int64_t, 3> steps(3, /*Value=*/1);
-    SmallVector<int64_t, 3> upperBounds(3);
-
-    // TODO: Update upper bounds according to shape
-    auto M = tensorType.getShape()[0];  // Rows of LHS
-    auto N = tensorType.getShape()[1];  // Columns of RHS
-    auto K = (operands[0].getType().cast<MemRefType>()).getShape()[1];  // Columns of LHS and Rows of RHS
-    upperBounds[0] = M;
-    upperBounds[1] = N;
-    upperBounds[2] = K;
-
-    buildAffineLoopNest(
-        rewriter, loc, lowerBounds, upperBounds, steps,
-        [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
-          typename pony::GemmOp::Adaptor gemmAdaptor(operands);
-          // TODO: Finish the build of affine loop
-          auto i = ivs[0], j = ivs[1], k = ivs[2];
+    auto alloc = insertAllocAndDealloc(memRefType, loc, rewriter, options);
 
-          // Generate loads for the element of 'lhs' and 'rhs' at the inner
-          auto lhs = nestedBuilder.create<AffineLoadOp>(loc, gemmAdaptor.getLhs(), ValueRange{i, k});
-          auto rhs = nestedBuilder.create<AffineLoadOp>(loc, gemmAdaptor.getRhs(), ValueRange{k, j});
-          auto mul = nestedBuilder.create<arith::MulFOp>(loc, lhs, rhs);
-          
-          // Generate an accumulator for the result of the multiplication.
-          auto current = nestedBuilder.create<AffineLoadOp>(loc, alloc, ValueRange{i, j});
-          auto updated = nestedBuilder.create<arith::AddFOp>(loc, current, mul);
-
-          // Store the result of the multiplication.
-          nestedBuilder.create<AffineStoreOp>(loc, updated, alloc, ValueRange{i, j});
-        });
+    // The kernels load `lhs` one element at a time, so a transposed `lhs` is
+    // simply read through a transposed view: a column of the micro-kernel is
+    // then contiguous in memory. The kernels walk the rows of `rhs` though,
+    // so a transposed `rhs` is packed into a contiguous buffer first, a single
+    // pass over it that is cheap next to the product.
+    auto gemmOp = cast<pony::GemmOp>(op);
+    pony::GemmOp::Adaptor gemmAdaptor(operands);
+    Value lhs = gemmAdaptor.getLhs();
+    if (gemmOp.getTransposeLhs())
+      lhs = buildTransposedView(rewriter, loc, lhs);
+    Value rhs = gemmAdaptor.getRhs();
+    if (gemmOp.getTransposeRhs())
+      rhs = getContiguousBuffer(buildTransposedView(rewriter, loc, rhs), loc,
+                                rewriter, options);
+    int64_t rows = memRefType.getShape()[0];
+    int64_t cols = memRefType.getShape()[1];
+    int64_t depth = lhs.getType().cast<MemRefType>().getShape()[1];
+
+    // The epilogue operands are read at the indices of the result elements,
+    // except for the splat constants.
+    ArrayAttr epilogueKinds = gemmOp.getEpilogueAttr();
+    SmallVector<FloatAttr, 2> epilogueSplats;
+    SmallVector<Value, 2> epilogueMemRefs;
+    for (Value operand : gemmOp.getEpilogueOperands())
+      epilogueSplats.push_back(getSplatConstant(operand));
+    for (auto it : llvm::zip(gemmAdaptor.getEpilogueOperands(), epilogueSplats))
+      if (!std::get<1>(it))
+        epilogueMemRefs.push_back(std::get<0>(it));
+
+    // When vectorizing, the micro-kernel holds rows of whole vectors. Only
+    // `rhs`, the epilogue operands and the result are accessed with vectors.
+    VectorType vectorType;
+    int64_t registerCols = kGemmRegisterCols;
+    if (options.vectorize && options.vectorWidth > 1 && isVectorizable(rhs) &&
+        isVectorizable(epilogueMemRefs)) {
+      vectorType =
+          VectorType::get({options.vectorWidth}, memRefType.getElementType());
+      registerCols = kGemmVectorsPerRow * options.vectorWidth;
+    }
+
+    SmallVector<GemmEpilogueOp, 2> epilogue;
+    for (unsigned index = 0, e = epilogueSplats.size(); index != e; ++index) {
+      bool isMul = epilogueKinds[index].cast<StringAttr>().getValue() == "mul";
+      FloatAttr splat = epilogueSplats[index];
+      if (!splat) {
+        epilogue.push_back(
+            {isMul, gemmAdaptor.getEpilogueOperands()[index], Value()});
+        continue;
+      }
+      Value splatValue =
+          vectorType ? rewriter.create<arith::ConstantOp>(
+                           loc, DenseElementsAttr::get(vectorType,
+                                                       splat.getValue()))
+                     : rewriter.create<arith::ConstantOp>(loc, splat);
+      epilogue.push_back({isMul, Value(), splatValue});
+    }
+
+    // The rows and columns covered by full register blocks go through the
+    // tiled micro-kernel, the remaining ones through a simple loop nest.
+    int64_t blockedRows = rows - rows % kGemmRegisterRows;
+    int64_t blockedCols = cols - cols % registerCols;
+    if (blockedRows && blockedCols) {
+      // The blocks are accumulated over several panels of the reduction
+      // dimension, so they have to start from zero.
+      Value zero = rewriter.create<arith::ConstantOp>(
+          loc, rewriter.getF64FloatAttr(0.0));
+      buildParallelizableLoopNest(
+          rewriter, loc, {0, 0}, {blockedRows, blockedCols}, {1, 1},
+          /*maxParallelLoops=*/2, blockedRows * blockedCols, options,
+          [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+            nestedBuilder.create<AffineStoreOp>(loc, zero, alloc, ivs);
+          });
+      buildBlockedGemm(rewriter, loc, lhs, rhs, alloc, blockedRows,
+                       blockedCols, depth, registerCols, vectorType, epilogue);
+    }
+
+    if (!vectorType) {
+      buildGemmLoopNest(rewriter, loc, lhs, rhs, alloc, {blockedRows, rows},
+                        {0, cols}, depth, epilogue);
+      buildGemmLoopNest(rewriter, loc, lhs, rhs, alloc, {0, blockedRows},
+                        {blockedCols, cols}, depth, epilogue);
+    } else {
+      // The remaining rows under the blocked columns, then the remaining
+      // columns as whole vectors, and finally the last partial vector of each
+      // row with a mask.
+      int64_t width = options.vectorWidth;
+      int64_t vectorCols = cols - cols % width;
+      buildVectorGemmLoopNest(rewriter, loc, lhs, rhs, alloc,
+                              {blockedRows, rows}, {0, blockedCols}, depth,
+                              vectorType, Value(), epilogue);
+      buildVectorGemmLoopNest(rewriter, loc, lhs, rhs, alloc, {0, rows},
+                              {blockedCols, vectorCols}, depth, vectorType,
+                              Value(), epilogue);
+      if (cols % width) {
+        Value mask = buildTailMask(rewriter, loc, width, cols % width);
+        buildVectorGemmLoopNest(rewriter, loc, lhs, rhs, alloc, {0, rows},
+                                {vectorCols, vectorCols + width}, depth,
+                                vectorType, mask, epilogue);
+      }
+    }
 
     rewriter.replaceOp(op, alloc);
     return success();
   }
+
+private:
+  /// Build the cache-tiled loop nest computing the `rows` x `cols` top-left
+  /// block of `out`, whose sizes are multiples of the register block:
+  ///
+  ///   for ic in [0, rows) step L2 tile       // Rows of `out` kept in L2.
+  ///     for jc in [0, cols) step L2 tile     // Columns of `out` kept in L2.
+  ///       for kc in [0, depth) step L1 tile  // Panel of `rhs` kept in L1.
+  ///         for i in tile(ic) step MR
+  ///           for j in tile(jc) step NR
+  ///             micro-kernel(i, j, kc)
+  ///
+  /// NR is `registerCols`. When a `vectorType` is given, the vectorized
+  /// micro-kernel is used. The blocks of `out` are independent, so the ic and
+  /// jc loops may run in parallel, while kc carries the accumulation. When
+  /// there is an epilogue, the last panel is peeled off the kc loop: its
+  /// micro-kernels apply the epilogue to the fully accumulated blocks while
+  /// they are still in registers.
+  void buildBlockedGemm(OpBuilder &builder, Location loc, Value lhs, Value rhs,
+                        Value out, int64_t rows, int64_t cols, int64_t depth,
+                        int64_t registerCols, VectorType vectorType,
+                        ArrayRef<GemmEpilogueOp> epilogue) const {
+    // The L2 tiles hold at least one register block.
+    int64_t l2TileSize = std::max<int64_t>(options.gemmL2TileSize, 1);
+    int64_t rowTile = roundUp(l2TileSize, kGemmRegisterRows);
+    int64_t colTile = roundUp(l2TileSize, registerCols);
+    int64_t depthTile = std::max<int64_t>(options.gemmL1TileSize, 1);
+    int64_t lastPanel =
+        epilogue.empty() ? depth : (depth - 1) / depthTile * depthTile;
+
+    // Build the loops over the register blocks of the tile at (ic, jc), for
+    // the panel that starts at `kc`.
+    auto buildPanel = [&](OpBuilder &panelBuilder, Location loc,
+                          ValueRange tileIvs, Value kc,
+                          ArrayRef<GemmEpilogueOp> panelEpilogue) {
+      buildTileLoop(
+          panelBuilder, loc, tileIvs[0], rowTile, rows, kGemmRegisterRows,
+          [&](OpBuilder &rowBuilder, Location loc, Value i) {
+            buildTileLoop(
+                rowBuilder, loc, tileIvs[1], colTile, cols, registerCols,
+                [&](OpBuilder &kernelBuilder, Location loc, Value j) {
+                  if (vectorType)
+                    buildVectorMicroKernel(kernelBuilder, loc, lhs, rhs, out,
+                                           i, j, kc, depthTile, depth,
+                                           vectorType, panelEpilogue);
+                  else
+                    buildMicroKernel(kernelBuilder, loc, lhs, rhs, out, i, j,
+                                     kc, depthTile, depth, panelEpilogue);
+                });
+          });
+    };
+
+    SmallVector<int64_t, 2> lowerBounds(2, /*Value=*/0);
+    SmallVector<int64_t, 2> upperBounds = {rows, cols};
+    SmallVector<int64_t, 2> steps = {rowTile, colTile};
+    buildParallelizableLoopNest(
+        builder, loc, lowerBounds, upperBounds, steps,
+        /*maxParallelLoops=*/2, rows * cols * depth, options,
+        [&](OpBuilder &nestedBuilder, Location loc, ValueRange tileIvs) {
+          if (lastPanel > 0)
+            buildAffineLoopNest(
+                nestedBuilder, loc, {0}, {lastPanel}, {depthTile},
+                [&](OpBuilder &panelBuilder, Location loc, ValueRange kc) {
+                  buildPanel(panelBuilder, loc, tileIvs, kc[0], llvm::None);
+                });
+          if (!epilogue.empty()) {
+            Value kc =
+                nestedBuilder.create<arith::ConstantIndexOp>(loc, lastPanel);
+            buildPanel(nestedBuilder, loc, tileIvs, kc, epilogue);
+          }
+        });
+  }
+
+  /// Apply the epilogue to `value`, the element or the vector of elements
+  /// along a row of the product at the indices `map` computes from `indices`.
+  /// When a `mask` is given, `map` must be the identity, and only the enabled
+  /// lanes of the epilogue operands are read.
+  static Value applyEpilogue(OpBuilder &builder, Location loc,
+                             ArrayRef<GemmEpilogueOp> epilogue, Value value,
+                             AffineMap map, ValueRange indices, Value mask) {
+    for (const GemmEpilogueOp &epilogueOp : epilogue) {
+      Value operand = epilogueOp.splat;
+      if (!operand) {
+        auto vectorType = value.getType().dyn_cast<VectorType>();
+        if (!vectorType)
+          operand = builder.create<AffineLoadOp>(loc, epilogueOp.memRef, map,
+                                                 indices);
+        else if (mask)
+          operand = buildVectorLoad(builder, loc, vectorType,
+                                    epilogueOp.memRef, indices, mask, value);
+        else
+          operand = builder.create<AffineVectorLoadOp>(
+              loc, vectorType, epilogueOp.memRef, map, indices);
+      }
+      if (epilogueOp.isMul)
+        value = builder.create<arith::MulFOp>(loc, value, operand);
+      else
+        value = builder.create<arith::AddFOp>(loc, value, operand);
+    }
+    return value;
+  }
+
+  /// Build the micro-kernel accumulating into the MR x NR register block of
+  /// `out` at (i, j) the products over the panel of the reduction dimension
+  /// that starts at `kc`. The partial sums are carried in registers through
+  /// the loop over the panel as `iter_args`: `out` is read and written once
+  /// per panel, while each step loads a column of MR elements of `lhs` and a
+  /// contiguous row of NR elements of `rhs` for the MR x NR products. The
+  /// `epilogue` is applied to the partial sums before they are stored.
+  static void buildMicroKernel(OpBuilder &builder, Location loc, Value lhs,
+                               Value rhs, Value out, Value i, Value j, Value kc,
+                               int64_t depthTile, int64_t depth,
+                               ArrayRef<GemmEpilogueOp> epilogue) {
+    MLIRContext *ctx = builder.getContext();
+    SmallVector<Value, kGemmRegisterRows * kGemmRegisterCols> partialSums;
+    for (int64_t r = 0; r < kGemmRegisterRows; ++r)
+      for (int64_t c = 0; c < kGemmRegisterCols; ++c)
+        partialSums.push_back(builder.create<AffineLoadOp>(
+            loc, out, getOffsetMap(ctx, r, c), ValueRange{i, j}));
+
+    auto panelLoop = builder.create<AffineForOp>(
+        loc, kc, AffineMap::getMultiDimIdentityMap(1, ctx), kc,
+        getTileUpperBoundMap(ctx, depthTile, depth), /*step=*/1, partialSums,
+        [&](OpBuilder &nestedBuilder, Location loc, Value k,
+            ValueRange sums) {
+          SmallVector<Value, kGemmRegisterRows> lhsColumn;
+          for (int64_t r = 0; r < kGemmRegisterRows; ++r)
+            lhsColumn.push_back(nestedBuilder.create<AffineLoadOp>(
+                loc, lhs, getOffsetMap(ctx, r, 0), ValueRange{i, k}));
+          SmallVector<Value, kGemmRegisterCols> rhsRow;
+          for (int64_t c = 0; c < kGemmRegisterCols; ++c)
+            rhsRow.push_back(nestedBuilder.create<AffineLoadOp>(
+                loc, rhs, getOffsetMap(ctx, 0, c), ValueRange{k, j}));
+
+          SmallVector<Value, kGemmRegisterRows * kGemmRegisterCols> updated;
+          for (int64_t r = 0; r < kGemmRegisterRows; ++r) {
+            for (int64_t c = 0; c < kGemmRegisterCols; ++c) {
+              auto mul = nestedBuilder.create<arith::MulFOp>(loc, lhsColumn[r],
+                                                             rhsRow[c]);
+              updated.push_back(nestedBuilder.create<arith::AddFOp>(
+                  loc, sums[r * kGemmRegisterCols + c], mul));
+            }
+          }
+          nestedBuilder.create<AffineYieldOp>(loc, updated);
+        });
+
+    for (int64_t r = 0; r < kGemmRegisterRows; ++r) {
+      for (int64_t c = 0; c < kGemmRegisterCols; ++c) {
+        AffineMap offsetMap = getOffsetMap(ctx, r, c);
+        Value sum = panelLoop.getResult(r * kGemmRegisterCols + c);
+        Value result = applyEpilogue(builder, loc, epilogue, sum, offsetMap,
+                                     ValueRange{i, j}, Value());
+        builder.create<AffineStoreOp>(loc, result, out, offsetMap,
+                                      ValueRange{i, j});
+      }
+    }
+  }
+
+  /// Build the vectorized counterpart of the micro-kernel above, holding
+  /// MR x kGemmVectorsPerRow vectors of partial sums. Each step of the panel
+  /// loads kGemmVectorsPerRow contiguous vectors from a row of `rhs`, and
+  /// accumulates their products with each of the MR elements of a column of
+  /// `lhs` broadcast to a vector with fused multiply-adds.
+  static void buildVectorMicroKernel(OpBuilder &builder, Location loc,
+                                     Value lhs, Value rhs, Value out, Value i,
+                                     Value j, Value kc, int64_t depthTile,
+                                     int64_t depth, VectorType vectorType,
+                                     ArrayRef<GemmEpilogueOp> epilogue) {
+    MLIRContext *ctx = builder.getContext();
+    int64_t width = vectorType.getNumElements();
+    SmallVector<Value, kGemmRegisterRows * kGemmVectorsPerRow> partialSums;
+    for (int64_t r = 0; r < kGemmRegisterRows; ++r)
+      for (int64_t v = 0; v < kGemmVectorsPerRow; ++v)
+        partialSums.push_back(builder.create<AffineVectorLoadOp>(
+            loc, vectorType, out, getOffsetMap(ctx, r, v * width),
+            ValueRange{i, j}));
+
+    auto panelLoop = builder.create<AffineForOp>(
+        loc, kc, AffineMap::getMultiDimIdentityMap(1, ctx), kc,
+        getTileUpperBoundMap(ctx, depthTile, depth), /*step=*/1, partialSums,
+        [&](OpBuilder &nestedBuilder, Location loc, Value k,
+            ValueRange sums) {
+          SmallVector<Value, kGemmVectorsPerRow> rhsRow;
+          for (int64_t v = 0; v < kGemmVectorsPerRow; ++v)
+            rhsRow.push_back(nestedBuilder.create<AffineVectorLoadOp>(
+                loc, vectorType, rhs, getOffsetMap(ctx, 0, v * width),
+                ValueRange{k, j}));
+
+          SmallVector<Value, kGemmRegisterRows * kGemmVectorsPerRow> updated;
+          for (int64_t r = 0; r < kGemmRegisterRows; ++r) {
+            auto lhsElement = nestedBuilder.create<AffineLoadOp>(
+                loc, lhs, getOffsetMap(ctx, r, 0), ValueRange{i, k});
+            auto lhsSplat = nestedBuilder.create<vector::SplatOp>(
+                loc, lhsElement, vectorType);
+            for (int64_t v = 0; v < kGemmVectorsPerRow; ++v)
+              updated.push_back(nestedBuilder.create<vector::FMAOp>(
+                  loc, lhsSplat, rhsRow[v], sums[r * kGemmVectorsPerRow + v]));
+          }
+          nestedBuilder.create<AffineYieldOp>(loc, updated);
+        });
+
+    for (int64_t r = 0; r < kGemmRegisterRows; ++r) {
+      for (int64_t v = 0; v < kGemmVectorsPerRow; ++v) {
+        AffineMap offsetMap = getOffsetMap(ctx, r, v * width);
+        Value sum = panelLoop.getResult(r * kGemmVectorsPerRow + v);
+        Value result = applyEpilogue(builder, loc, epilogue, sum, offsetMap,
+                                     ValueRange{i, j}, Value());
+        builder.create<AffineVectorStoreOp>(loc, result, out, offsetMap,
+                                            ValueRange{i, j});
+      }
+    }
+  }
+
+  /// Build an untiled loop nest computing the block [rowRange) x [colRange)
+  /// of `out`. Each element is reduced over the whole depth in a register
+  /// carried as `iter_args`, and stored once after applying the `epilogue`.
+  void buildGemmLoopNest(OpBuilder &builder, Location loc, Value lhs,
+                         Value rhs, Value out,
+                         std::pair<int64_t, int64_t> rowRange,
+                         std::pair<int64_t, int64_t> colRange, int64_t depth,
+                         ArrayRef<GemmEpilogueOp> epilogue) const {
+    if (rowRange.first == rowRange.second ||
+        colRange.first == colRange.second)
+      return;
+
+    Value zero =
+        builder.create<arith::ConstantOp>(loc, builder.getF64FloatAttr(0.0));
+    SmallVector<int64_t, 2> lowerBounds = {rowRange.first, colRange.first};
+    SmallVector<int64_t, 2> upperBounds = {rowRange.second, colRange.second};
+    SmallVector<int64_t, 2> steps(2, /*Value=*/1);
+    int64_t work = (rowRange.second - rowRange.first) *
+                   (colRange.second - colRange.first) * depth;
+    buildParallelizableLoopNest(
+        builder, loc, lowerBounds, upperBounds, steps,
+        /*maxParallelLoops=*/2, work, options,
+        [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+          Value i = ivs[0], j = ivs[1];
+          auto reduction = nestedBuilder.create<AffineForOp>(
+              loc, /*lowerBound=*/0, /*upperBound=*/depth, /*step=*/1,
+              ValueRange{zero},
+              [&](OpBuilder &reductionBuilder, Location loc, Value k,
+                  ValueRange sum) {
+                auto lhsElement = reductionBuilder.create<AffineLoadOp>(
+                    loc, lhs, ValueRange{i, k});
+                auto rhsElement = reductionBuilder.create<AffineLoadOp>(
+                    loc, rhs, ValueRange{k, j});
+                auto mul = reductionBuilder.create<arith::MulFOp>(
+                    loc, lhsElement, rhsElement);
+                Value updated =
+                    reductionBuilder.create<arith::AddFOp>(loc, sum[0], mul);
+                reductionBuilder.create<AffineYieldOp>(loc, updated);
+              });
+          Value result = applyEpilogue(
+              nestedBuilder, loc, epilogue, reduction.getResult(0),
+              nestedBuilder.getMultiDimIdentityMap(2), ValueRange{i, j},
+              Value());
+          nestedBuilder.create<AffineStoreOp>(loc, result, out,
+                                              ValueRange{i, j});
+        });
+  }
+
+  /// Build the vectorized counterpart of the loop nest above, computing the
+  /// block of `out` one vector of columns at a time: the length of `colRange`
+  /// is a multiple of the vector width. When a `mask` is given, only its
+  /// enabled lanes are read from `rhs` and written to `out`, which handles the
+  /// last partial vector of the rows.
+  void buildVectorGemmLoopNest(OpBuilder &builder, Location loc, Value lhs,
+                               Value rhs, Value out,
+                               std::pair<int64_t, int64_t> rowRange,
+                               std::pair<int64_t, int64_t> colRange,
+                               int64_t depth, VectorType vectorType,
+                               Value mask,
+                               ArrayRef<GemmEpilogueOp> epilogue) const {
+    if (rowRange.first == rowRange.second ||
+        colRange.first == colRange.second)
+      return;
+
+    Value zero = builder.create<arith::ConstantOp>(
+        loc, builder.getZeroAttr(vectorType));
+    SmallVector<int64_t, 2> lowerBounds = {rowRange.first, colRange.first};
+    SmallVector<int64_t, 2> upperBounds = {rowRange.second, colRange.second};
+    SmallVector<int64_t, 2> steps = {1, vectorType.getNumElements()};
+    int64_t work = (rowRange.second - rowRange.first) *
+                   (colRange.second - colRange.first) * depth;
+    buildParallelizableLoopNest(
+        builder, loc, lowerBounds, upperBounds, steps,
+        /*maxParallelLoops=*/2, work, options,
+        [&](OpBuilder &nestedBuilder, Location loc, ValueRange ivs) {
+          Value i = ivs[0], j = ivs[1];
+          auto reduction = nestedBuilder.create<AffineForOp>(
+              loc, /*lowerBound=*/0, /*upperBound=*/depth, /*step=*/1,
+              ValueRange{zero},
+              [&](OpBuilder &reductionBuilder, Location loc, Value k,
+                  ValueRange sum) {
+                auto lhsElement = reductionBuilder.create<AffineLoadOp>(
+                    loc, lhs, ValueRange{i, k});
+                auto lhsSplat = reductionBuilder.create<vector::SplatOp>(
+                    loc, lhsElement, vectorType);
+                Value rhsRow = buildVectorLoad(reductionBuilder, loc,
+                                               vectorType, rhs,
+                                               ValueRange{k, j}, mask, zero);
+                Value updated = reductionBuilder.create<vector::FMAOp>(
+                    loc, lhsSplat, rhsRow, sum[0]);
+                reductionBuilder.create<AffineYieldOp>(loc, updated);
+              });
+          Value result = applyEpilogue(
+              nestedBuilder, loc, epilogue, reduction.getResult(0),
+              nestedBuilder.getMultiDimIdentityMap(2), ValueRange{i, j}, mask);
+          buildVectorStore(nestedBuilder, loc, result, out, ValueRange{i, j},
+                           mask);
+        });
+  }
+
+  pony::AffineLoweringOptions options;
 };
 
 //===----------------------------------------------------------------------===//
@@ -185,68 +1115,82 @@ struct GemmOpLowering : public ConversionPattern {
 //===----------------------------------------------------------------------===//
 
 struct ConstantOpLowering : public OpRewritePattern<pony::ConstantOp> {
-  using OpRewritePattern<pony::ConstantOp>::OpRewritePattern;
+  ConstantOpLowering(MLIRContext *ctx,
+                     const pony::AffineLoweringOptions &options)
+      : OpRewritePattern<pony::ConstantOp>(ctx), options(options) {}
 
   LogicalResult matchAndRewrite(pony::ConstantOp op,
                                 PatternRewriter &rewriter) const final {
     DenseElementsAttr constantValue = op.getValue();
     Location loc = op.getLoc();
 
-    // When lowering the constant operation, we allocate and assign the constant
-    // values to a corresponding memref allocation.
+    if (constantValue.isSplat()) {
+      // The splats only used as scalars are legal, and erased once their users
+      // are lowered. The others fill a buffer with a single loop nest rather
+      // than keeping every element in memory. LLVM turns the fill with zeros
+      // into a memset.
+      auto memRefType = convertTensorToMemRef(op.getType().cast<TensorType>());
+      auto alloc = insertAllocAndDealloc(memRefType, loc, rewriter, options);
+      Value splatValue = rewriter.create<arith::ConstantOp>(
+          loc, constantValue.getSplatValue<FloatAttr>());
+      insertFill(splatValue, alloc, loc, rewriter, options);
+      rewriter.replaceOp(op, alloc);
+      return success();
+    }
+
+    // When lowering the constant operation, we place the constant values in a
+    // read-only global buffer, initialized at load time, and refer to it where
+    // the constant is defined. Nothing is copied at runtime.
     auto tensorType = op.getType().cast<TensorType>();
     auto memRefType = convertTensorToMemRef(tensorType);
-    auto alloc = insertAllocAndDealloc(memRefType, loc, rewriter);
-
-    // We will be generating constant indices up-to the largest dimension.
-    // Create these constants up-front to avoid large amounts of redundant
-    // operations.
-    auto valueShape = memRefType.getShape();
-    SmallVector<Value, 8> constantIndices;
-
-    if (!valueShape.empty()) {
-      for (auto i : llvm::seq<int64_t>(
-               0, *std::max_element(valueShape.begin(), valueShape.end())))
-        constantIndices.push_back(
-            rewriter.create<arith::ConstantIndexOp>(loc, i));
-    } else {
-      // This is the case of a tensor of rank 0.
-      constantIndices.push_back(
-          rewriter.create<arith::ConstantIndexOp>(loc, 0));
+    auto module = op->getParentOfType<ModuleOp>();
+    std::string name = getGlobalName(module, memRefType, constantValue);
+    if (!module.lookupSymbol<memref::GlobalOp>(name)) {
+      OpBuilder::InsertionGuard guard(rewriter);
+      rewriter.setInsertionPointToStart(module.getBody());
+      rewriter.create<memref::GlobalOp>(
+          loc, name, /*sym_visibility=*/rewriter.getStringAttr("private"),
+          memRefType, constantValue, /*constant=*/true,
+          /*alignment=*/rewriter.getI64IntegerAttr(kGlobalAlignment));
     }
 
-    // The constant operation represents a multi-dimensional constant, so we
-    // will need to generate a store for each of the elements. The following
-    // functor recursively walks the dimensions of the constant shape,
-    // generating a store when the recursion hits the base case.
-    SmallVector<Value, 2> indices;
-    auto valueIt = constantValue.value_begin<FloatAttr>();
-    std::function<void(uint64_t)> storeElements = [&](uint64_t dimension) {
-      // The last dimension is the base case of the recursion, at this point
-      // we store the element at the given index.
-      if (dimension == valueShape.size()) {
-        rewriter.create<AffineStoreOp>(
-            loc, rewriter.create<arith::ConstantOp>(loc, *valueIt++), alloc,
-            llvm::makeArrayRef(indices));
-        return;
-      }
+    // Replace this operation with a reference to the global.
+    rewriter.replaceOpWithNewOp<memref::GetGlobalOp>(op, memRefType, name);
+    return success();
+  }
 
-      // Otherwise, iterate over the current dimension and add the indices to
-      // the list.
-      for (uint64_t i = 0, e = valueShape[dimension]; i != e; ++i) {
-        indices.push_back(constantIndices[i]);
-        storeElements(dimension + 1);
-        indices.pop_back();
-      }
-    };
+private:
+  /// Alignment of the global buffers in bytes, that of a cache line.
+  static constexpr int64_t kGlobalAlignment = 64;
 
-    // Start the element storing recursion from the first dimension.
-    storeElements(/*dimension=*/0);
+  /// Return the name of the global holding the given constant value. The name
+  /// is derived from the shape and the content of the value, so that equal
+  /// constants share the same global. A global of `module` already named so
+  /// is only reused if it holds the same value, the name being suffixed with
+  /// a counter otherwise.
+  static std::string getGlobalName(ModuleOp module, MemRefType type,
+                                   DenseElementsAttr value) {
+    std::string name;
+    llvm::raw_string_ostream os(name);
+    os << "__constant_";
+    for (int64_t dim : type.getShape())
+      os << dim << "x";
+    os << type.getElementType() << "_";
+    ArrayRef<char> rawData = value.getRawData();
+    os.write_hex(llvm::xxHash64(StringRef(rawData.data(), rawData.size())));
+    os.flush();
 
-    // Replace this operation with the generated alloc.
-    rewriter.replaceOp(op, alloc);
-    return success();
+    // Distinct values may have the same hash.
+    std::string uniqueName = name;
+    for (unsigned suffix = 0;; ++suffix) {
+      auto global = module.lookupSymbol<memref::GlobalOp>(uniqueName);
+      if (!global || global.initial_value() == Attribute(value))
+        return uniqueName;
+      uniqueName = name + "_" + std::to_string(suffix);
+    }
   }
+
+  pony::AffineLoweringOptions options;
 };
 
 //===----------------------------------------------------------------------===//
@@ -259,27 +1203,93 @@ struct FuncOpLowering : public OpConversionPattern<pony::FuncOp> {
   LogicalResult
   matchAndRewrite(pony::FuncOp op, OpAdaptor adaptor,
                   ConversionPatternRewriter &rewriter) const final {
-    // We only lower the main function as we expect that all other functions
-    // have been inlined.
-    if (op.getName() != "main")
-      return failure();
+    FunctionType funcType = op.getFunctionType();
 
     // Verify that the given main has no inputs and results.
-    if (op.getNumArguments() || op.getFunctionType().getNumResults()) {
+    if (op.getName() == "main" &&
+        (op.getNumArguments() || funcType.getNumResults())) {
       return rewriter.notifyMatchFailure(op, [](Diagnostic &diag) {
         diag << "expected 'main' to have 0 inputs and 0 results";
       });
     }
 
+    // Other functions are expected to have been specialized for the shapes of
+    // their arguments.
+    auto isStaticTensor = [](Type type) {
+      auto tensorType = type.dyn_cast<RankedTensorType>();
+      return tensorType && tensorType.hasStaticShape();
+    };
+    if (!llvm::all_of(funcType.getInputs(), isStaticTensor) ||
+        !llvm::all_of(funcType.getResults(), isStaticTensor)) {
+      return rewriter.notifyMatchFailure(op, [](Diagnostic &diag) {
+        diag << "expected a function specialized for static shapes";
+      });
+    }
+
+    // The arguments are converted to memrefs, and each result is turned into a
+    // trailing memref argument that the function writes into.
+    TypeConverter::SignatureConversion signature(op.getNumArguments());
+    for (const auto &it : llvm::enumerate(funcType.getInputs()))
+      signature.addInputs(it.index(),
+                          convertTensorToMemRef(it.value().cast<TensorType>()));
+    for (Type resultType : funcType.getResults())
+      signature.addInputs(convertTensorToMemRef(resultType.cast<TensorType>()));
+
     // Create a new non-pony function, with the same region.
-    auto func = rewriter.create<mlir::FuncOp>(op.getLoc(), op.getName(),
-                                              op.getFunctionType());
+    auto func = rewriter.create<mlir::FuncOp>(
+        op.getLoc(), op.getName(),
+        rewriter.getFunctionType(signature.getConvertedTypes(), llvm::None));
+    if (op.isPrivate())
+      func.setPrivate();
     rewriter.inlineRegionBefore(op.getRegion(), func.getBody(), func.end());
+    rewriter.applySignatureConversion(&func.getBody(), signature);
     rewriter.eraseOp(op);
     return success();
   }
 };
 
+//===----------------------------------------------------------------------===//
+// PonyToAffine RewritePatterns: GenericCall operations
+//===----------------------------------------------------------------------===//
+
+struct GenericCallOpLowering : public OpConversionPattern<pony::GenericCallOp> {
+  GenericCallOpLowering(MLIRContext *ctx,
+                        const pony::AffineLoweringOptions &options)
+      : OpConversionPattern<pony::GenericCallOp>(ctx), options(options) {}
+
+  LogicalResult
+  matchAndRewrite(pony::GenericCallOp op, OpAdaptor adaptor,
+                  ConversionPatternRewriter &rewriter) const final {
+    auto tensorType = op.getType().dyn_cast<RankedTensorType>();
+    if (!tensorType || !tensorType.hasStaticShape()) {
+      return rewriter.notifyMatchFailure(op, [](Diagnostic &diag) {
+        diag << "expected a call to a function specialized for static shapes";
+      });
+    }
+
+    // The caller owns the result buffer, and passes it to the callee as a
+    // trailing argument.
+    Location loc = op.getLoc();
+    auto alloc =
+        insertAllocAndDealloc(convertTensorToMemRef(tensorType), loc, rewriter,
+                              options);
+    // The callee expects contiguous buffers, views are copied into one.
+    SmallVector<Value, 4> callOperands;
+    for (Value input : adaptor.getInputs())
+      callOperands.push_back(
+          getContiguousBuffer(input, loc, rewriter, options));
+    callOperands.push_back(alloc);
+    rewriter.create<func::CallOp>(loc, op.getCalleeAttr(), TypeRange(),
+                                  callOperands);
+
+    // Replace this operation with the generated alloc.
+    rewriter.replaceOp(op, alloc);
+    return success();
+  }
+
+  pony::AffineLoweringOptions options;
+};
+
 //===----------------------------------------------------------------------===//
 // PonyToAffine RewritePatterns: Print operations
 //===----------------------------------------------------------------------===//
@@ -298,19 +1308,68 @@ struct PrintOpLowering : public OpConversionPattern<pony::PrintOp> {
   }
 };
 
+//===----------------------------------------------------------------------===//
+// PonyToAffine RewritePatterns: Reshape operations
+//===----------------------------------------------------------------------===//
+
+struct ReshapeOpLowering : public ConversionPattern {
+  ReshapeOpLowering(MLIRContext *ctx,
+                    const pony::AffineLoweringOptions &options)
+      : ConversionPattern(pony::ReshapeOp::getOperationName(), 1, ctx),
+        options(options) {}
+
+  LogicalResult
+  matchAndRewrite(Operation *op, ArrayRef<Value> operands,
+                  ConversionPatternRewriter &rewriter) const final {
+    auto loc = op->getLoc();
+    auto memRefType =
+        convertTensorToMemRef((*op->result_type_begin()).cast<TensorType>());
+
+    // Reshaping keeps the elements in row-major order, so the result is a view
+    // of the contiguous input buffer with the new shape.
+    pony::ReshapeOpAdaptor reshapeAdaptor(operands);
+    Value input =
+        getContiguousBuffer(reshapeAdaptor.getInput(), loc, rewriter, options);
+    SmallVector<int64_t, 4> strides;
+    int64_t offset;
+    (void)getStridesAndOffset(memRefType, strides, offset);
+    rewriter.replaceOpWithNewOp<memref::ReinterpretCastOp>(
+        op, memRefType, input, offset, memRefType.getShape(), strides);
+    return success();
+  }
+
+  pony::AffineLoweringOptions options;
+};
+
 //===----------------------------------------------------------------------===//
 // PonyToAffine RewritePatterns: Return operations
 //===----------------------------------------------------------------------===//
 
-struct ReturnOpLowering : public OpRewritePattern<pony::ReturnOp> {
-  using OpRewritePattern<pony::ReturnOp>::OpRewritePattern;
+struct ReturnOpLowering : public OpConversionPattern<pony::ReturnOp> {
+  using OpConversionPattern<pony::ReturnOp>::OpConversionPattern;
 
-  LogicalResult matchAndRewrite(pony::ReturnOp op,
-                                PatternRewriter &rewriter) const final {
-    // During this lowering, we expect that all function calls have been
-    // inlined.
-    if (op.hasOperand())
-      return failure();
+  LogicalResult
+  matchAndRewrite(pony::ReturnOp op, OpAdaptor adaptor,
+                  ConversionPatternRewriter &rewriter) const final {
+    // A returned value is written into the destination buffer that the
+    // caller passed as the trailing argument of the function.
+    if (op.hasOperand()) {
+      Value result = adaptor.getInput().front();
+      Value dest = op->getParentOfType<mlir::FuncOp>().getArguments().back();
+
+      Operation *alloc = result.getDefiningOp();
+      if (isa_and_nonnull<memref::AllocOp, memref::AllocaOp>(alloc)) {
+        // The result was computed in a local buffer: compute it directly in the
+        // destination instead, and drop the local buffer.
+        for (Operation *user : llvm::make_early_inc_range(alloc->getUsers()))
+          if (isa<memref::DeallocOp>(user))
+            rewriter.eraseOp(user);
+        rewriter.replaceOp(alloc, dest);
+      } else {
+        // Otherwise, e.g. when returning an argument, copy it over.
+        insertCopy(result, dest, op.getLoc(), rewriter);
+      }
+    }
 
     // We lower "pony.return" directly to "func.return".
     rewriter.replaceOpWithNewOp<func::ReturnOp>(op);
@@ -329,22 +1388,11 @@ struct TransposeOpLowering : public ConversionPattern {
   LogicalResult
   matchAndRewrite(Operation *op, ArrayRef<Value> operands,
                   ConversionPatternRewriter &rewriter) const final {
-    auto loc = op->getLoc();
-    lowerOpToLoops(op, operands, rewriter,
-                   [loc](OpBuilder &builder, ValueRange memRefOperands,
-                         ValueRange loopIvs) {
-                     // Generate an adaptor for the remapped operands of the
-                     // TransposeOp. This allows for using the nice named
-                     // accessors that are generated by the ODS.
-                     pony::TransposeOpAdaptor transposeAdaptor(memRefOperands);
-                     Value input = transposeAdaptor.getInput();
-
-                     // Transpose the elements by generating a load from the
-                     // reverse indices.
-                     SmallVector<Value, 2> reverseIvs(llvm::reverse(loopIvs));
-                     return builder.create<AffineLoadOp>(loc, input,
-                                                         reverseIvs);
-                   });
+    // The result is a view of the input: no element is moved, and consumers
+    // index the input through the strided layout of the view.
+    pony::TransposeOpAdaptor transposeAdaptor(operands);
+    rewriter.replaceOp(op, buildTransposedView(rewriter, op->getLoc(),
+                                               transposeAdaptor.getInput()));
     return success();
   }
 };
@@ -355,16 +1403,113 @@ struct TransposeOpLowering : public ConversionPattern {
 // PonyToAffineLoweringPass
 //===----------------------------------------------------------------------===//
 
+/// Maximum number of operations produced by fully unrolling a loop accessing
+/// stack buffers.
+static constexpr uint64_t kFullUnrollBudget = 256;
+
+/// Fully unroll the innermost loops accessing stack buffers, as long as the
+/// code doesn't grow too much, and then the loops enclosing them. The buffers
+/// are then accessed with constant indices, which lets LLVM promote them to
+/// registers.
+static void unrollStackBufferLoops(Operation *root) {
+  // Loops are collected in post-order, i.e. inner loops first.
+  SmallVector<AffineForOp, 8> loops;
+  root->walk([&](AffineForOp forOp) { loops.push_back(forOp); });
+
+  for (AffineForOp forOp : loops) {
+    Optional<uint64_t> tripCount = getConstantTripCount(forOp);
+    if (!tripCount)
+      continue;
+
+    uint64_t numOps = 0;
+    bool hasNestedLoop = false;
+    bool accessesStack = false;
+    forOp.getBody()->walk([&](Operation *op) {
+      ++numOps;
+      hasNestedLoop |= isa<AffineForOp, AffineParallelOp>(op);
+      accessesStack |= llvm::any_of(op->getOperands(), [](Value operand) {
+        return operand.getDefiningOp<memref::AllocaOp>();
+      });
+    });
+    if (accessesStack && !hasNestedLoop &&
+        *tripCount * numOps <= kFullUnrollBudget)
+      (void)loopUnrollFull(forOp);
+  }
+}
+
 /// This is a partial lowering to affine loops of the pony operations that are
 /// computationally intensive (like matmul for example...) while keeping the
 /// rest of the code in the Pony dialect.
 namespace {
 struct PonyToAffineLoweringPass
     : public PassWrapper<PonyToAffineLoweringPass, OperationPass<ModuleOp>> {
+  StringRef getArgument() const final { return "pony-lower-to-affine"; }
+  StringRef getDescription() const final {
+    return "Lower the Pony operations to affine loops";
+  }
+
+  PonyToAffineLoweringPass() = default;
+  PonyToAffineLoweringPass(const PonyToAffineLoweringPass &pass)
+      : PassWrapper(pass) {}
+  PonyToAffineLoweringPass(const pony::AffineLoweringOptions &options) {
+    gemmL1TileSize = options.gemmL1TileSize;
+    gemmL2TileSize = options.gemmL2TileSize;
+    vectorize = options.vectorize;
+    vectorWidth = options.vectorWidth;
+    numThreads = options.numThreads;
+    parallelGrainSize = options.parallelGrainSize;
+    inPlace = options.inPlace;
+    stackAllocThreshold = options.stackAllocThreshold;
+  }
+
   void getDependentDialects(DialectRegistry &registry) const override {
-    registry.insert<AffineDialect, func::FuncDialect, memref::MemRefDialect>();
+    registry.insert<AffineDialect, func::FuncDialect, memref::MemRefDialect,
+                    vector::VectorDialect>();
   }
   void runOnOperation() final;
+
+  Option<unsigned> gemmL1TileSize{
+      *this, "gemm-l1-tile-size",
+      llvm::cl::desc("Depth of the GEMM reduction panels kept in L1"),
+      llvm::cl::init(pony::AffineLoweringOptions().gemmL1TileSize)};
+  Option<unsigned> gemmL2TileSize{
+      *this, "gemm-l2-tile-size",
+      llvm::cl::desc("Rows and columns of the GEMM result blocks kept in L2"),
+      llvm::cl::init(pony::AffineLoweringOptions().gemmL2TileSize)};
+  Option<bool> vectorize{
+      *this, "vectorize",
+      llvm::cl::desc("Lower GEMM and elementwise operations to vector loops"),
+      llvm::cl::init(pony::AffineLoweringOptions().vectorize)};
+  Option<unsigned> vectorWidth{
+      *this, "vector-width",
+      llvm::cl::desc("Number of elements in the vectors used when vectorizing"),
+      llvm::cl::init(pony::AffineLoweringOptions().vectorWidth)};
+  Option<unsigned> numThreads{
+      *this, "threads",
+      llvm::cl::desc("Number of threads running the parallel loops, loops are "
+                     "kept sequential when it is 1"),
+      llvm::cl::init(pony::AffineLoweringOptions().numThreads)};
+  Option<unsigned> parallelGrainSize{
+      *this, "parallel-grain-size",
+      llvm::cl::desc("Minimum number of scalar operations worth running a "
+                     "loop nest in parallel"),
+      llvm::cl::init(pony::AffineLoweringOptions().parallelGrainSize)};
+  Option<bool> inPlace{
+      *this, "in-place",
+      llvm::cl::desc("Store the result of elementwise operations into the "
+                     "buffer of an operand that dies"),
+      llvm::cl::init(pony::AffineLoweringOptions().inPlace)};
+  Option<unsigned> stackAllocThreshold{
+      *this, "stack-alloc-threshold",
+      llvm::cl::desc("Maximum size in bytes of the buffers allocated on the "
+                     "stack"),
+      llvm::cl::init(pony::AffineLoweringOptions().stackAllocThreshold)};
+
+  Statistic numAllocations{this, "num-allocations",
+                           "Number of buffers allocated by the lowering"};
+  Statistic numStackAllocations{
+      this, "num-stack-allocations",
+      "Number of buffers allocated on the stack by the lowering"};
 };
 } // namespace
 
@@ -375,10 +1520,10 @@ void PonyToAffineLoweringPass::runOnOperation() {
 
   // We define the specific operations, or dialects, that are legal targets for
   // this lowering. In our case, we are lowering to a combination of the
-  // `Affine`, `Arithmetic`, `Func`, and `MemRef` dialects.
-  target
-      .addLegalDialect<AffineDialect, BuiltinDialect, arith::ArithmeticDialect,
-                       func::FuncDialect, memref::MemRefDialect>();
+  // `Affine`, `Arithmetic`, `Func`, `MemRef` and `Vector` dialects.
+  target.addLegalDialect<AffineDialect, BuiltinDialect,
+                         arith::ArithmeticDialect, func::FuncDialect,
+                         memref::MemRefDialect, vector::VectorDialect>();
 
   // We also define the Pony dialect as Illegal so that the conversion will fail
   // if any of these operations are *not* converted. Given that we actually want
@@ -392,23 +1537,52 @@ void PonyToAffineLoweringPass::runOnOperation() {
                          [](Type type) { return type.isa<TensorType>(); });
   });
 
+  // The splat constants only used as scalars are read by the lowering of their
+  // users, and erased once these are lowered.
+  target.addDynamicallyLegalOp<pony::ConstantOp>(isScalarSplat);
+
   // Now that the conversion target has been defined, we just need to provide
   // the set of patterns that will lower the Pony operations.
   RewritePatternSet patterns(&getContext());
-  patterns.add<AddOpLowering, ConstantOpLowering, FuncOpLowering, MulOpLowering,
-               PrintOpLowering, ReturnOpLowering, TransposeOpLowering, GemmOpLowering>(
-      &getContext());
+  patterns.add<FuncOpLowering, PrintOpLowering, ReturnOpLowering,
+               TransposeOpLowering>(&getContext());
+
+  pony::AffineLoweringOptions options;
+  options.gemmL1TileSize = gemmL1TileSize;
+  options.gemmL2TileSize = gemmL2TileSize;
+  options.vectorize = vectorize;
+  options.vectorWidth = vectorWidth;
+  options.numThreads = numThreads;
+  options.parallelGrainSize = parallelGrainSize;
+  options.inPlace = inPlace;
+  options.stackAllocThreshold = stackAllocThreshold;
+  patterns.add<AddOpLowering, ConstantOpLowering, FusedElementwiseOpLowering,
+               GemmOpLowering, GenericCallOpLowering, MulOpLowering,
+               ReshapeOpLowering>(&getContext(), options);
 
   // With the target and rewrite patterns defined, we can now attempt the
   // conversion. The conversion will signal failure if any of our `illegal`
   // operations were not converted successfully.
   if (failed(
-          applyPartialConversion(getOperation(), target, std::move(patterns))))
+          applyPartialConversion(getOperation(), target, std::move(patterns)))) {
     signalPassFailure();
+    return;
+  }
+  getOperation().walk([](pony::ConstantOp op) {
+    assert(op->use_empty() && "splat constant used after the lowering");
+    op.erase();
+  });
+
+  getOperation().walk([&](memref::AllocOp) { ++numAllocations; });
+  getOperation().walk([&](memref::AllocaOp) { ++numStackAllocations; });
+
+  if (stackAllocThreshold)
+    unrollStackBufferLoops(getOperation());
 }
 
 /// Create a pass for lowering operations in the `Affine` and `Std` dialects,
 /// for a subset of the Pony IR (e.g. matmul).
-std::unique_ptr<Pass> mlir::pony::createLowerToAffinePass() {
-  return std::make_unique<PonyToAffineLoweringPass>();
+std::unique_ptr<Pass>
+mlir::pony::createLowerToAffinePass(const AffineLoweringOptions &options) {
+  return std::make_unique<PonyToAffineLoweringPass>(options);
 }
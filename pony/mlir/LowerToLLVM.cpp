@@ -3,18 +3,19 @@
 //===----------------------------------------------------------------------===//
 //
 // This file implements full lowering of Pony operations to LLVM MLIR dialect.
-// 'pony.print' is lowered to a loop nest that calls `printf` on each element of
-// the input array. The file also sets up the PonyToLLVMLoweringPass. This pass
-// lowers the combination of Arithmetic + Affine + SCF + Func dialects to the
-// LLVM one:
+// 'pony.print' is lowered to a call into the Pony runtime, which prints the
+// whole input array at once. The file also sets up the PonyToLLVMLoweringPass.
+// This pass lowers the combination of Arithmetic + Affine + SCF + Func +
+// Vector dialects to the LLVM one, the vector transfers that can't be mapped to
+// LLVM loads and stores being first rewritten as loops:
 //
 //                         Affine --
 //                                  |
 //                                  v
-//                       Arithmetic + Func --> LLVM (Dialect)
+//              Arithmetic + Func + Vector --> LLVM (Dialect)
 //                                  ^
 //                                  |
-//     'pony.print' --> Loop (SCF) --
+// 'pony.print' --> MemRef + Func --
 //
 //===----------------------------------------------------------------------===//
 
@@ -29,16 +30,20 @@
 #include "mlir/Conversion/LLVMCommon/ConversionTarget.h"
 #include "mlir/Conversion/LLVMCommon/TypeConverter.h"
 #include "mlir/Conversion/MemRefToLLVM/MemRefToLLVM.h"
+#include "mlir/Conversion/OpenMPToLLVM/ConvertOpenMPToLLVM.h"
 #include "mlir/Conversion/SCFToControlFlow/SCFToControlFlow.h"
+#include "mlir/Conversion/VectorToLLVM/ConvertVectorToLLVM.h"
+#include "mlir/Conversion/VectorToSCF/VectorToSCF.h"
 #include "mlir/Dialect/Affine/IR/AffineOps.h"
 #include "mlir/Dialect/Arithmetic/IR/Arithmetic.h"
 #include "mlir/Dialect/Func/IR/FuncOps.h"
 #include "mlir/Dialect/LLVMIR/LLVMDialect.h"
 #include "mlir/Dialect/MemRef/IR/MemRef.h"
 #include "mlir/Dialect/SCF/SCF.h"
+#include "mlir/Dialect/Vector/Transforms/VectorTransforms.h"
 #include "mlir/Pass/Pass.h"
 #include "mlir/Transforms/DialectConversion.h"
-#include "llvm/ADT/Sequence.h"
+#include "mlir/Transforms/GreedyPatternRewriteDriver.h"
 
 using namespace mlir;
 
@@ -47,60 +52,38 @@ using namespace mlir;
 //===----------------------------------------------------------------------===//
 
 namespace {
-/// Lowers `pony.print` to a loop nest calling `printf` on each of the individual
-/// elements of the array.
+/// Lowers `pony.print` to a call to the Pony runtime, which prints the whole
+/// array at once: `ponyPrintMemrefF64` formats it as text, and
+/// `ponyPrintMemrefBinaryF64` writes its raw elements. The array is passed as
+/// an unranked memref, so that a single function prints arrays of any rank.
 class PrintOpLowering : public ConversionPattern {
 public:
-  explicit PrintOpLowering(MLIRContext *context)
-      : ConversionPattern(pony::PrintOp::getOperationName(), 1, context) {}
+  PrintOpLowering(MLIRContext *context, pony::PrintFormat printFormat)
+      : ConversionPattern(pony::PrintOp::getOperationName(), 1, context),
+        printFormat(printFormat) {}
 
   LogicalResult
   matchAndRewrite(Operation *op, ArrayRef<Value> operands,
                   ConversionPatternRewriter &rewriter) const override {
-    auto memRefType = (*op->operand_type_begin()).cast<MemRefType>();
-    auto memRefShape = memRefType.getShape();
+    auto printOp = cast<pony::PrintOp>(op);
+    auto memRefType = printOp.getInput().getType().cast<MemRefType>();
+    auto unrankedType = UnrankedMemRefType::get(memRefType.getElementType(),
+                                                memRefType.getMemorySpace());
     auto loc = op->getLoc();
 
+    // Get a symbol reference to the runtime function, inserting it if
+    // necessary.
     ModuleOp parentModule = op->getParentOfType<ModuleOp>();
+    StringRef name = printFormat == pony::PrintFormat::Binary
+                         ? "ponyPrintMemrefBinaryF64"
+                         : "ponyPrintMemrefF64";
+    auto printRef =
+        getOrInsertPrintMemref(rewriter, parentModule, name, unrankedType);
 
-    // Get a symbol reference to the printf function, inserting it if necessary.
-    auto printfRef = getOrInsertPrintf(rewriter, parentModule);
-    Value formatSpecifierCst = getOrCreateGlobalString(
-        loc, rewriter, "frmt_spec", StringRef("%f \0", 4), parentModule);
-    Value newLineCst = getOrCreateGlobalString(
-        loc, rewriter, "nl", StringRef("\n\0", 2), parentModule);
-
-    // Create a loop for each of the dimensions within the shape.
-    SmallVector<Value, 4> loopIvs;
-    for (unsigned i = 0, e = memRefShape.size(); i != e; ++i) {
-      auto lowerBound = rewriter.create<arith::ConstantIndexOp>(loc, 0);
-      auto upperBound =
-          rewriter.create<arith::ConstantIndexOp>(loc, memRefShape[i]);
-      auto step = rewriter.create<arith::ConstantIndexOp>(loc, 1);
-      auto loop =
-          rewriter.create<scf::ForOp>(loc, lowerBound, upperBound, step);
-      for (Operation &nested : *loop.getBody())
-        rewriter.eraseOp(&nested);
-      loopIvs.push_back(loop.getInductionVar());
-
-      // Terminate the loop body.
-      rewriter.setInsertionPointToEnd(loop.getBody());
-
-      // Insert a newline after each of the inner dimensions of the shape.
-      if (i != e - 1)
-        rewriter.create<func::CallOp>(loc, printfRef,
-                                      rewriter.getIntegerType(32), newLineCst);
-      rewriter.create<scf::YieldOp>(loc);
-      rewriter.setInsertionPointToStart(loop.getBody());
-    }
-
-    // Generate a call to printf for the current element of the loop.
-    auto printOp = cast<pony::PrintOp>(op);
-    auto elementLoad =
-        rewriter.create<memref::LoadOp>(loc, printOp.getInput(), loopIvs);
-    rewriter.create<func::CallOp>(
-        loc, printfRef, rewriter.getIntegerType(32),
-        ArrayRef<Value>({formatSpecifierCst, elementLoad}));
+    // Erase the rank of the array and print it.
+    Value unranked =
+        rewriter.create<memref::CastOp>(loc, unrankedType, printOp.getInput());
+    rewriter.create<func::CallOp>(loc, printRef, TypeRange(), unranked);
 
     // Notify the rewriter that this operation has been removed.
     rewriter.eraseOp(op);
@@ -108,56 +91,30 @@ public:
   }
 
 private:
-  /// Return a symbol reference to the printf function, inserting it into the
-  /// module if necessary.
-  static FlatSymbolRefAttr getOrInsertPrintf(PatternRewriter &rewriter,
-                                             ModuleOp module) {
+  /// Return a symbol reference to the runtime function printing arrays,
+  /// declaring it in the module if necessary. The declaration is lowered with
+  /// the C interface of the runtime, taking a pointer to the memref descriptor.
+  static FlatSymbolRefAttr getOrInsertPrintMemref(PatternRewriter &rewriter,
+                                                  ModuleOp module,
+                                                  StringRef name,
+                                                  Type unrankedType) {
     auto *context = module.getContext();
-    if (module.lookupSymbol<LLVM::LLVMFuncOp>("printf"))
-      return SymbolRefAttr::get(context, "printf");
-
-    // Create a function declaration for printf, the signature is:
-    //   * `i32 (i8*, ...)`
-    auto llvmI32Ty = IntegerType::get(context, 32);
-    auto llvmI8PtrTy = LLVM::LLVMPointerType::get(IntegerType::get(context, 8));
-    auto llvmFnType = LLVM::LLVMFunctionType::get(llvmI32Ty, llvmI8PtrTy,
-                                                  /*isVarArg=*/true);
+    if (module.lookupSymbol(name))
+      return SymbolRefAttr::get(context, name);
 
-    // Insert the printf function into the body of the parent module.
+    // Insert the declaration into the body of the parent module.
     PatternRewriter::InsertionGuard insertGuard(rewriter);
     rewriter.setInsertionPointToStart(module.getBody());
-    rewriter.create<LLVM::LLVMFuncOp>(module.getLoc(), "printf", llvmFnType);
-    return SymbolRefAttr::get(context, "printf");
+    auto funcType = rewriter.getFunctionType(unrankedType, {});
+    auto printFunc =
+        rewriter.create<mlir::FuncOp>(module.getLoc(), name, funcType);
+    printFunc.setPrivate();
+    printFunc->setAttr(LLVM::LLVMDialect::getEmitCWrapperAttrName(),
+                       UnitAttr::get(context));
+    return SymbolRefAttr::get(context, name);
   }
 
-  /// Return a value representing an access into a global string with the given
-  /// name, creating the string if necessary.
-  static Value getOrCreateGlobalString(Location loc, OpBuilder &builder,
-                                       StringRef name, StringRef value,
-                                       ModuleOp module) {
-    // Create the global at the entry of the module.
-    LLVM::GlobalOp global;
-    if (!(global = module.lookupSymbol<LLVM::GlobalOp>(name))) {
-      OpBuilder::InsertionGuard insertGuard(builder);
-      builder.setInsertionPointToStart(module.getBody());
-      auto type = LLVM::LLVMArrayType::get(
-          IntegerType::get(builder.getContext(), 8), value.size());
-      global = builder.create<LLVM::GlobalOp>(loc, type, /*isConstant=*/true,
-                                              LLVM::Linkage::Internal, name,
-                                              builder.getStringAttr(value),
-                                              /*alignment=*/0);
-    }
-
-    // Get the pointer to the first character in the global string.
-    Value globalPtr = builder.create<LLVM::AddressOfOp>(loc, global);
-    Value cst0 = builder.create<LLVM::ConstantOp>(
-        loc, IntegerType::get(builder.getContext(), 64),
-        builder.getIntegerAttr(builder.getIndexType(), 0));
-    return builder.create<LLVM::GEPOp>(
-        loc,
-        LLVM::LLVMPointerType::get(IntegerType::get(builder.getContext(), 8)),
-        globalPtr, ArrayRef<Value>({cst0, cst0}));
-  }
+  pony::PrintFormat printFormat;
 };
 } // namespace
 
@@ -168,14 +125,46 @@ private:
 namespace {
 struct PonyToLLVMLoweringPass
     : public PassWrapper<PonyToLLVMLoweringPass, OperationPass<ModuleOp>> {
+  StringRef getArgument() const final { return "pony-lower-to-llvm"; }
+  StringRef getDescription() const final {
+    return "Lower the Pony, affine and standard operations to LLVM";
+  }
+
+  PonyToLLVMLoweringPass() = default;
+  PonyToLLVMLoweringPass(const PonyToLLVMLoweringPass &pass)
+      : PassWrapper(pass) {}
+  PonyToLLVMLoweringPass(pony::PrintFormat printFormat) {
+    this->printFormat = printFormat;
+  }
+
   void getDependentDialects(DialectRegistry &registry) const override {
     registry.insert<LLVM::LLVMDialect, scf::SCFDialect>();
   }
   void runOnOperation() final;
+
+  Option<pony::PrintFormat> printFormat{
+      *this, "print-format",
+      llvm::cl::desc("Format in which `pony.print` writes arrays"),
+      llvm::cl::init(pony::PrintFormat::Text),
+      llvm::cl::values(
+          clEnumValN(pony::PrintFormat::Text, "text",
+                     "elements formatted as decimal numbers"),
+          clEnumValN(pony::PrintFormat::Binary, "binary",
+                     "shape header followed by the raw f64 elements"))};
 };
 } // namespace
 
 void PonyToLLVMLoweringPass::runOnOperation() {
+  // The vector operations created by the affine super-vectorizer are not all
+  // supported by the LLVM patterns: broadcasts are first rewritten as splats,
+  // and the 1-D transfers that broadcast an element, read along a dimension
+  // other than the innermost one or access a memref whose innermost stride is
+  // not 1 are rewritten as loops of scalar accesses.
+  RewritePatternSet vectorPatterns(&getContext());
+  vector::populateVectorBroadcastLoweringPatterns(vectorPatterns);
+  populateVectorToSCFConversionPatterns(vectorPatterns);
+  (void)applyPatternsAndFoldGreedily(getOperation(), std::move(vectorPatterns));
+
   // The first thing to define is the conversion target. This will define the
   // final target for this lowering. For this lowering, we are only targeting
   // the LLVM dialect.
@@ -189,6 +178,10 @@ void PonyToLLVMLoweringPass::runOnOperation() {
   // doing more complicated lowerings, involving loop region arguments.
   LLVMTypeConverter typeConverter(&getContext());
 
+  // Parallel loops may have been converted to the `omp` dialect, whose
+  // operations remain but need their regions converted to LLVM types.
+  configureOpenMPToLLVMConversionLegality(target, typeConverter);
+
   // Now that the conversion target has been defined, we need to provide the
   // patterns used for lowering. At this point of the compilation process, we
   // have a combination of `pony`, `affine`, and `std` operations. Luckily, there
@@ -205,10 +198,12 @@ void PonyToLLVMLoweringPass::runOnOperation() {
   populateMemRefToLLVMConversionPatterns(typeConverter, patterns);
   cf::populateControlFlowToLLVMConversionPatterns(typeConverter, patterns);
   populateFuncToLLVMConversionPatterns(typeConverter, patterns);
+  populateVectorToLLVMConversionPatterns(typeConverter, patterns);
+  populateOpenMPToLLVMConversionPatterns(typeConverter, patterns);
 
   // The only remaining operation to lower from the `pony` dialect, is the
   // PrintOp.
-  patterns.add<PrintOpLowering>(&getContext());
+  patterns.add<PrintOpLowering>(&getContext(), printFormat);
 
   // We want to completely lower to LLVM, so we use a `FullConversion`. This
   // ensures that only legal operations will remain after the conversion.
@@ -219,6 +214,7 @@ void PonyToLLVMLoweringPass::runOnOperation() {
 
 /// Create a pass for lowering operations the remaining `Pony` operations, as
 /// well as `Affine` and `Std`, to the LLVM dialect for codegen.
-std::unique_ptr<mlir::Pass> mlir::pony::createLowerToLLVMPass() {
-  return std::make_unique<PonyToLLVMLoweringPass>();
+std::unique_ptr<mlir::Pass>
+mlir::pony::createLowerToLLVMPass(PrintFormat printFormat) {
+  return std::make_unique<PonyToLLVMLoweringPass>(printFormat);
 }
@@ -0,0 +1,220 @@
+//===- MatrixChainReordering.cpp - Reassociation of GEMM chains -----------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a Function level pass reassociating the chains of Pony
+// matrix products. The parser evaluates `a @ b @ c` from left to right whatever
+// the shapes, while the cost of a chain varies by orders of magnitude with the
+// order of its products. The order performing the fewest floating point
+// operations is found with the classic matrix-chain dynamic program.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Pass/Pass.h"
+#include "pony/Dialect.h"
+#include "pony/Passes.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <functional>
+#include <limits>
+
+#define DEBUG_TYPE "matrix-chain-reordering"
+
+using namespace mlir;
+using namespace pony;
+
+/// Return the shape of the given matrix, or None if it is not a statically
+/// shaped 2-d tensor.
+static Optional<std::pair<int64_t, int64_t>> getMatrixShape(Value value) {
+  auto type = value.getType().dyn_cast<RankedTensorType>();
+  if (!type || type.getRank() != 2 || !type.hasStaticShape())
+    return llvm::None;
+  return std::make_pair(type.getDimSize(0), type.getDimSize(1));
+}
+
+/// Return the number of floating point operations of the product of a m x k
+/// matrix by a k x n matrix.
+static int64_t getGemmFlops(int64_t m, int64_t k, int64_t n) {
+  return 2 * m * k * n;
+}
+
+namespace {
+/// A chain of matrix products, rooted at a GemmOp.
+struct GemmChain {
+  /// The matrices multiplied by the chain, in order.
+  SmallVector<Value, 8> matrices;
+  /// The products of the chain other than the root, parents first. They are
+  /// erased once the chain is reassociated.
+  SmallVector<GemmOp, 8> innerProducts;
+  /// The number of floating point operations of the chain as associated.
+  int64_t flops = 0;
+};
+} // namespace
+
+static bool collectChain(GemmOp product, GemmChain &chain);
+
+/// Add to `chain` the matrices multiplied by the given operand of a product
+/// of the chain. An operand computed by a plain product that has no other use
+/// belongs to the chain, and is expanded recursively. Return false if the
+/// chain multiplies matrices that are not statically shaped.
+static bool collectOperand(Value operand, GemmChain &chain) {
+  auto product = operand.getDefiningOp<GemmOp>();
+  if (!product || !operand.hasOneUse() || product.getTransposeLhs() ||
+      product.getTransposeRhs() || !product.getEpilogueOperands().empty()) {
+    chain.matrices.push_back(operand);
+    return getMatrixShape(operand).hasValue();
+  }
+  chain.innerProducts.push_back(product);
+  return collectChain(product, chain);
+}
+
+/// Add to `chain` the matrices multiplied by the given product, and the
+/// floating point operations computing it.
+static bool collectChain(GemmOp product, GemmChain &chain) {
+  if (!collectOperand(product.getLhs(), chain) ||
+      !collectOperand(product.getRhs(), chain))
+    return false;
+  auto lhsShape = getMatrixShape(product.getLhs());
+  auto rhsShape = getMatrixShape(product.getRhs());
+  if (!lhsShape || !rhsShape || lhsShape->second != rhsShape->first)
+    return false;
+  chain.flops += getGemmFlops(lhsShape->first, lhsShape->second,
+                              rhsShape->second);
+  return true;
+}
+
+namespace {
+/// The MatrixChainReorderingPass visits the GemmOps of a function from the
+/// last one, so that the root of every chain is visited before its inner
+/// products:
+///
+///   1) The chain rooted at the GemmOp is collected: the operands produced by
+///      GemmOps without transposed operands nor epilogue, and with no other
+///      use, are expanded into the matrices they multiply.
+///   2) For the matrices M0 x ... x Mn-1, Mi being of size p[i] x p[i+1], the
+///      minimal cost of multiplying Mi to Mj is
+///        cost(i, i) = 0
+///        cost(i, j) = min over i <= k < j of
+///                       cost(i, k) + cost(k + 1, j) + 2 p[i] p[k+1] p[j+1]
+///      and the split `k` achieving it is recorded.
+///   3) When the best order saves operations, the inner products are rebuilt
+///      following the recorded splits, and the root multiplies the two last
+///      ones. Its transpose and epilogue attributes are kept.
+///
+/// The pass expects the shapes to be inferred, so that the cost of the chains
+/// is known.
+class MatrixChainReorderingPass
+    : public mlir::PassWrapper<MatrixChainReorderingPass,
+                               OperationPass<pony::FuncOp>> {
+public:
+  StringRef getArgument() const final { return "pony-matrix-chain-reordering"; }
+  StringRef getDescription() const final {
+    return "Reassociate the chains of matrix products";
+  }
+
+  void runOnOperation() override {
+    SmallVector<GemmOp, 8> products;
+    getOperation().walk([&](GemmOp product) { products.push_back(product); });
+
+    llvm::DenseSet<Operation *> innerProducts;
+    for (GemmOp root : llvm::reverse(products)) {
+      if (innerProducts.count(root))
+        continue;
+      // The chain stops at transposed operands.
+      if (root.getTransposeLhs() || root.getTransposeRhs())
+        continue;
+
+      GemmChain chain;
+      if (!collectChain(root, chain))
+        continue;
+      for (GemmOp product : chain.innerProducts)
+        innerProducts.insert(product);
+      if (chain.matrices.size() > 2)
+        reorderChain(root, chain);
+    }
+  }
+
+private:
+  /// Reassociate the given chain if that saves floating point operations.
+  void reorderChain(GemmOp root, GemmChain &chain) {
+    size_t numMatrices = chain.matrices.size();
+    SmallVector<int64_t, 8> dims;
+    for (Value matrix : chain.matrices)
+      dims.push_back(getMatrixShape(matrix)->first);
+    dims.push_back(getMatrixShape(chain.matrices.back())->second);
+
+    // cost[i][j] is the minimal cost of multiplying the matrices i to j, and
+    // split[i][j] the last matrix of the left hand side of their product.
+    std::vector<std::vector<int64_t>> cost(
+        numMatrices, std::vector<int64_t>(numMatrices, 0));
+    std::vector<std::vector<size_t>> split(
+        numMatrices, std::vector<size_t>(numMatrices, 0));
+    for (size_t length = 2; length <= numMatrices; ++length) {
+      for (size_t i = 0, e = numMatrices - length; i <= e; ++i) {
+        size_t j = i + length - 1;
+        cost[i][j] = std::numeric_limits<int64_t>::max();
+        for (size_t k = i; k < j; ++k) {
+          int64_t candidate =
+              cost[i][k] + cost[k + 1][j] +
+              getGemmFlops(dims[i], dims[k + 1], dims[j + 1]);
+          if (candidate < cost[i][j]) {
+            cost[i][j] = candidate;
+            split[i][j] = k;
+          }
+        }
+      }
+    }
+
+    int64_t bestFlops = cost[0][numMatrices - 1];
+    LLVM_DEBUG(llvm::dbgs() << "Chain of " << numMatrices << " matrices: "
+                            << chain.flops << " flops, " << bestFlops
+                            << " flops when reordered\n");
+    flopsBefore += chain.flops;
+    if (bestFlops >= chain.flops) {
+      flopsAfter += chain.flops;
+      return;
+    }
+    flopsAfter += bestFlops;
+    ++numReorderedChains;
+
+    // Rebuild the products following the splits, right before the root.
+    OpBuilder builder(root);
+    Type elementType =
+        root.getType().cast<RankedTensorType>().getElementType();
+    std::function<Value(size_t, size_t)> buildProduct = [&](size_t i,
+                                                            size_t j) {
+      if (i == j)
+        return chain.matrices[i];
+      Value lhs = buildProduct(i, split[i][j]);
+      Value rhs = buildProduct(split[i][j] + 1, j);
+      auto product = builder.create<GemmOp>(root.getLoc(), lhs, rhs);
+      product.getResult().setType(
+          RankedTensorType::get({dims[i], dims[j + 1]}, elementType));
+      return product.getResult();
+    };
+    size_t rootSplit = split[0][numMatrices - 1];
+    Value lhs = buildProduct(0, rootSplit);
+    Value rhs = buildProduct(rootSplit + 1, numMatrices - 1);
+    root->setOperand(0, lhs);
+    root->setOperand(1, rhs);
+
+    // The previous inner products are now dead, parents first.
+    for (GemmOp product : chain.innerProducts)
+      product.erase();
+  }
+
+  Statistic flopsBefore{this, "flops-before",
+                        "Floating point operations of the GEMM chains"};
+  Statistic flopsAfter{this, "flops-after",
+                       "Floating point operations of the reordered GEMM "
+                       "chains"};
+  Statistic numReorderedChains{this, "num-reordered-chains",
+                               "Number of GEMM chains reassociated"};
+};
+} // namespace
+
+/// Create a Matrix Chain Reordering pass.
+std::unique_ptr<mlir::Pass> mlir::pony::createMatrixChainReorderingPass() {
+  return std::make_unique<MatrixChainReorderingPass>();
+}
@@ -0,0 +1,26 @@
+//===- Passes.cpp - Registration of the Pony passes -----------------------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file registers the Pony passes, so that textual pass pipelines can
+// refer to them by their argument.
+//
+//===----------------------------------------------------------------------===//
+
+#include "mlir/Pass/PassRegistry.h"
+#include "pony/Passes.h"
+
+void mlir::pony::registerPonyPasses() {
+  registerPass([] { return createShapeInferencePass(); });
+  registerPass([] { return createFunctionSpecializationPass(); });
+  registerPass([] { return createInlineCostModelPass(/*threshold=*/64); });
+  registerPass([] { return createMatrixChainReorderingPass(); });
+  registerPass([] { return createElementwiseFusionPass(); });
+  registerPass([] { return createLowerToAffinePass(); });
+  registerPass([] { return createBufferPlanningPass(); });
+  registerPass([] { return createHorizontalFusionPass(); });
+  registerPass([] { return createAffineVectorizationPass(/*vectorWidth=*/4); });
+  registerPass([] { return createAffineUnrollJamPass(/*factor=*/4); });
+  registerPass([] { return createAsyncExecutionPass(); });
+  registerPass([] { return createLowerToLLVMPass(); });
+}
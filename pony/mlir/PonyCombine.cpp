@@ -18,6 +18,25 @@
 using namespace mlir;
 using namespace pony;
 
+/// Create the GemmOp computing the product of `gemm`, followed by its epilogue
+/// and then the elementwise operation `kind` with `operand`. The new GemmOp
+/// replaces `res`, the result of that elementwise operation.
+static Value appendGemmEpilogue(OpBuilder &builder, Value res, Value gemm,
+                                Value operand, StringRef kind) {
+  auto gemmOp = gemm.getDefiningOp<GemmOp>();
+  SmallVector<Value, 4> operands(gemmOp->getOperands());
+  operands.push_back(operand);
+  SmallVector<Attribute, 4> epilogue;
+  if (ArrayAttr previous = gemmOp.getEpilogueAttr())
+    epilogue.append(previous.begin(), previous.end());
+  epilogue.push_back(builder.getStringAttr(kind));
+
+  auto fused = builder.create<GemmOp>(res.getLoc(), res.getType(), operands,
+                                      gemmOp->getAttrs());
+  fused.setEpilogueAttr(builder.getArrayAttr(epilogue));
+  return fused;
+}
+
 namespace {
 /// Include the patterns defined in the Declarative Rewrite framework.
 #include "PonyCombine.inc"
@@ -80,6 +99,58 @@ void TransposeOp::getCanonicalizationPatterns(RewritePatternSet &results,
   results.add<SimplifyRedundantTranspose>(context);
 }
 
+/// Fold the transposes producing the operands of a GemmOp into its
+/// `transpose_lhs` and `transpose_rhs` attributes:
+///   gemm(transpose(a), b) -> gemm(a, b) {transpose_lhs = true}
+/// so that the lowering reads `a` with the transposed layout directly instead
+/// of going through a transposed view. Folding an operand that is already
+/// transposed turns the attribute off.
+struct FoldTransposeIntoGemm : public mlir::OpRewritePattern<GemmOp> {
+  FoldTransposeIntoGemm(mlir::MLIRContext *context)
+      : OpRewritePattern<GemmOp>(context, /*benefit=*/1) {}
+
+  mlir::LogicalResult
+  matchAndRewrite(GemmOp op, mlir::PatternRewriter &rewriter) const override {
+    auto lhsTranspose = op.getLhs().getDefiningOp<TransposeOp>();
+    auto rhsTranspose = op.getRhs().getDefiningOp<TransposeOp>();
+    if (!lhsTranspose && !rhsTranspose)
+      return failure();
+
+    rewriter.updateRootInPlace(op, [&] {
+      if (lhsTranspose) {
+        op->setOperand(0, lhsTranspose.getOperand());
+        op.setTransposeLhsAttr(rewriter.getBoolAttr(!op.getTransposeLhs()));
+      }
+      if (rhsTranspose) {
+        op->setOperand(1, rhsTranspose.getOperand());
+        op.setTransposeRhsAttr(rewriter.getBoolAttr(!op.getTransposeRhs()));
+      }
+    });
+    return success();
+  }
+};
+
+/// Register our patterns as "canonicalization" patterns on the GemmOp so that
+/// they can be picked up by the Canonicalization framework.
+void GemmOp::getCanonicalizationPatterns(RewritePatternSet &results,
+                                         MLIRContext *context) {
+  results.add<FoldTransposeIntoGemm>(context);
+}
+
+/// Register our patterns as "canonicalization" patterns on the AddOp so that
+/// they can be picked up by the Canonicalization framework.
+void AddOp::getCanonicalizationPatterns(RewritePatternSet &results,
+                                        MLIRContext *context) {
+  results.add<FuseAddIntoGemmPattern, FuseCommutedAddIntoGemmPattern>(context);
+}
+
+/// Register our patterns as "canonicalization" patterns on the MulOp so that
+/// they can be picked up by the Canonicalization framework.
+void MulOp::getCanonicalizationPatterns(RewritePatternSet &results,
+                                        MLIRContext *context) {
+  results.add<FuseMulIntoGemmPattern, FuseCommutedMulIntoGemmPattern>(context);
+}
+
 /// Register our patterns as "canonicalization" patterns on the ReshapeOp so
 /// that they can be picked up by the Canonicalization framework.
 void ReshapeOp::getCanonicalizationPatterns(RewritePatternSet &results,
@@ -43,6 +43,11 @@ namespace {
 class ShapeInferencePass
     : public mlir::PassWrapper<ShapeInferencePass, OperationPass<pony::FuncOp>> {
 public:
+  StringRef getArgument() const final { return "pony-shape-inference"; }
+  StringRef getDescription() const final {
+    return "Infer the shapes of the Pony operations";
+  }
+
   void runOnOperation() override {
     auto f = getOperation();
 
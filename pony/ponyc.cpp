@@ -10,30 +10,60 @@
 #include "pony/MLIRGen.h"
 #include "pony/Parser.h"
 #include "pony/Passes.h"
+#include "pony/Runtime.h"
 
+#include "mlir/Conversion/AffineToStandard/AffineToStandard.h"
+#include "mlir/Conversion/AsyncToLLVM/AsyncToLLVM.h"
+#include "mlir/Conversion/SCFToOpenMP/SCFToOpenMP.h"
 #include "mlir/Dialect/Affine/Passes.h"
-#include "mlir/ExecutionEngine/ExecutionEngine.h"
+#include "mlir/Dialect/Async/Passes.h"
 #include "mlir/ExecutionEngine/OptUtils.h"
 #include "mlir/IR/AsmState.h"
 #include "mlir/IR/BuiltinOps.h"
 #include "mlir/IR/MLIRContext.h"
 #include "mlir/IR/Verifier.h"
 #include "mlir/InitAllDialects.h"
+#include "mlir/InitAllPasses.h"
 #include "mlir/Parser/Parser.h"
 #include "mlir/Pass/Pass.h"
 #include "mlir/Pass/PassManager.h"
+#include "mlir/Pass/PassRegistry.h"
 #include "mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h"
+#include "mlir/Target/LLVMIR/Dialect/OpenMP/OpenMPToLLVMIRTranslation.h"
 #include "mlir/Target/LLVMIR/Export.h"
 #include "mlir/Transforms/Passes.h"
 
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/MC/MCSubtargetInfo.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <thread>
 
 using namespace pony;
 namespace cl = llvm::cl;
@@ -61,7 +91,9 @@ enum Action {
   DumpMLIRAffine,
   DumpMLIRLLVM,
   DumpLLVMIR,
-  RunJIT
+  RunJIT,
+  EmitObject,
+  EmitShared
 };
 } // namespace
 static cl::opt<enum Action> emitAction(
@@ -76,9 +108,243 @@ static cl::opt<enum Action> emitAction(
     cl::values(clEnumValN(DumpLLVMIR, "llvm", "output the LLVM IR dump")),
     cl::values(
         clEnumValN(RunJIT, "jit",
-                   "JIT the code and run it by invoking the main function")));
+                   "JIT the code and run it by invoking the main function")),
+    cl::values(clEnumValN(EmitObject, "obj", "output a native object file")),
+    cl::values(clEnumValN(EmitShared, "shared",
+                          "output a native shared library, to run with "
+                          "pony-run")));
+
+static cl::opt<std::string>
+    outputFilename("o", cl::desc("Output file of -emit=obj and -emit=shared"),
+                   cl::value_desc("filename"));
+
+static cl::opt<std::string> runtimeLibDir(
+    "runtime-lib-dir",
+    cl::desc("Directory of the Pony runtime library linked in the shared "
+             "libraries (defaults to the lib directory next to the compiler)"),
+    cl::value_desc("directory"));
+
+static cl::opt<bool> enableOpt("opt", cl::desc("Enable optimizations, as -O3"));
+
+namespace {
+enum OptLevel { O0, O1, O2, O3 };
+} // namespace
+static cl::opt<enum OptLevel> optimizationLevel(
+    cl::desc("Optimization level of the MLIR and LLVM pipelines:"),
+    cl::values(clEnumVal(O0, "no optimization, LLVM -O0 (default)")),
+    cl::values(clEnumVal(O1, "scalar replacement of the affine memory "
+                             "accesses, LLVM -O1")),
+    cl::values(clEnumVal(O2, "fusion of the elementwise operations and of "
+                             "the loop nests, buffer planning, LLVM -O2")),
+    cl::values(clEnumVal(O3, "the -O2 pipeline with loop invariant code "
+                             "motion, tiling, super-vectorization and "
+                             "unroll-and-jam of the affine loops, LLVM -O3")),
+    cl::init(O0));
+
+static cl::opt<unsigned> tilingCacheSize(
+    "tiling-cache-size", cl::init(512),
+    cl::desc("Cache size in KiB that the affine loop tiling of -O3 fits the "
+             "footprint of the tiles in"));
+
+static cl::opt<unsigned> unrollJamFactor(
+    "unroll-jam-factor", cl::init(4),
+    cl::desc("Unroll-and-jam factor of the inner affine loops at -O3"));
+
+static cl::opt<std::string> passPipeline(
+    "pipeline",
+    cl::desc("Textual MLIR pass pipeline replacing the one of the "
+             "optimization level, e.g. 'pony-function-specialization,"
+             "pony.func(pony-shape-inference),pony-lower-to-affine,"
+             "pony-lower-to-llvm'"),
+    cl::value_desc("pipeline"));
+
+static cl::opt<bool> disableInlining(
+    "no-inline",
+    cl::desc("Keep calls to the shape-specialized functions out of line"));
+
+static cl::opt<unsigned> inlineThreshold(
+    "inline-threshold", cl::init(64),
+    cl::desc("Maximum code growth, in lowered operations, accepted to inline "
+             "a function at all of its call sites"));
+
+static cl::opt<bool> disableInPlace(
+    "no-in-place",
+    cl::desc("Always allocate a new buffer for the result of elementwise "
+             "operations"));
+
+static cl::opt<unsigned> stackAllocThreshold(
+    "stack-alloc-threshold",
+    cl::init(mlir::pony::AffineLoweringOptions().stackAllocThreshold),
+    cl::desc("Maximum size in bytes of the buffers allocated on the stack"));
+
+static cl::opt<unsigned> gemmL1TileSize(
+    "gemm-l1-tile-size",
+    cl::init(mlir::pony::AffineLoweringOptions().gemmL1TileSize),
+    cl::desc("Depth of the GEMM reduction panels kept in L1"));
+
+static cl::opt<unsigned> gemmL2TileSize(
+    "gemm-l2-tile-size",
+    cl::init(mlir::pony::AffineLoweringOptions().gemmL2TileSize),
+    cl::desc("Rows and columns of the GEMM result blocks kept in L2"));
+
+static cl::opt<bool> enableVectorization(
+    "vectorize",
+    cl::desc("Lower GEMM and elementwise operations to SIMD vector loops"));
+
+static cl::opt<unsigned> vectorWidth(
+    "vector-width", cl::init(0),
+    cl::desc("Number of f64 elements in the vectors used when vectorizing "
+             "(0 selects the SIMD width of the target)"));
+
+static cl::opt<unsigned> numThreads(
+    "threads", cl::init(1),
+    cl::desc("Number of threads running the Pony operations, with the OpenMP "
+             "runtime (0 uses every hardware thread)"));
+
+static cl::opt<unsigned> parallelGrainSize(
+    "parallel-grain-size",
+    cl::init(mlir::pony::AffineLoweringOptions().parallelGrainSize),
+    cl::desc("Minimum number of scalar operations worth running a loop nest "
+             "in parallel"));
+
+static cl::list<std::string>
+    sharedLibs("shared-libs",
+               cl::desc("Libraries to load in the JIT, e.g. the OpenMP "
+                        "runtime when running with several threads or the "
+                        "async runtime with -async"),
+               cl::ZeroOrMore, cl::MiscFlags::CommaSeparated);
+
+static cl::opt<mlir::pony::PrintFormat> printFormat(
+    "print-format", cl::init(mlir::pony::PrintFormat::Text),
+    cl::desc("Format in which print writes arrays, to the standard output or "
+             "to the file named by PONY_PRINT_FILE"),
+    cl::values(clEnumValN(mlir::pony::PrintFormat::Text, "text",
+                          "elements formatted as decimal numbers")),
+    cl::values(clEnumValN(mlir::pony::PrintFormat::Binary, "binary",
+                          "rank and dimensions as 64-bit integers, followed "
+                          "by the raw f64 elements")));
+
+static cl::opt<std::string> targetCPU(
+    "mcpu", cl::init("native"),
+    cl::desc("Target CPU of the generated code: 'native' for the host CPU "
+             "with all of its features, or an LLVM CPU name such as "
+             "'generic' or 'skylake-avx512'"),
+    cl::value_desc("cpu-name"));
+
+static cl::list<std::string>
+    targetFeatures("mattr",
+                   cl::desc("Target features to enable or disable on top of "
+                            "the CPU ones, e.g. -mattr=+avx2,-avx512f"),
+                   cl::value_desc("a1,+a2,-a3,..."), cl::ZeroOrMore,
+                   cl::MiscFlags::CommaSeparated);
+
+static cl::opt<bool> enableJitCache(
+    "jit-cache",
+    cl::desc("Cache the machine code of the JIT-compiled modules on disk, "
+             "in the directory given by -jit-cache-dir"));
+
+static cl::opt<std::string> jitCacheDir(
+    "jit-cache-dir",
+    cl::desc("Directory of the JIT cache, which -jit-cache enables "
+             "(defaults to ponyc in the user cache directory)"),
+    cl::value_desc("directory"));
+
+static cl::opt<bool> enableAsync(
+    "async",
+    cl::desc("Run the independent loop nests of a function concurrently, "
+             "with the MLIR async runtime"));
+
+/// Returns the optimization level, -opt being a shorthand for -O3.
+static unsigned getOptLevel() {
+  if (optimizationLevel.getNumOccurrences())
+    return optimizationLevel;
+  return enableOpt ? 3 : 0;
+}
+
+/// Returns the optimization level of the LLVM code generator.
+static llvm::CodeGenOpt::Level getCodeGenOptLevel() {
+  switch (getOptLevel()) {
+  case 0:
+    return llvm::CodeGenOpt::None;
+  case 1:
+    return llvm::CodeGenOpt::Less;
+  case 2:
+    return llvm::CodeGenOpt::Default;
+  default:
+    return llvm::CodeGenOpt::Aggressive;
+  }
+}
+
+/// Returns the number of threads requested to run the Pony operations.
+static unsigned getNumThreads() {
+  return numThreads ? unsigned(numThreads)
+                    : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/// Returns a builder of target machines for the CPU and the features selected
+/// with -mcpu and -mattr.
+static llvm::Expected<llvm::orc::JITTargetMachineBuilder>
+getTargetMachineBuilder() {
+  llvm::orc::JITTargetMachineBuilder builder(
+      llvm::Triple(llvm::sys::getProcessTriple()));
+  if (targetCPU == "native") {
+    auto host = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!host)
+      return host.takeError();
+    builder = std::move(*host);
+  } else {
+    builder.setCPU(targetCPU);
+  }
+  builder.addFeatures(std::vector<std::string>(targetFeatures.begin(),
+                                               targetFeatures.end()));
+  builder.setCodeGenOptLevel(getCodeGenOptLevel());
+  return builder;
+}
+
+/// Creates the target machine described by `builder`, and sets the data
+/// layout and the triple of `llvmModule` for it.
+static std::unique_ptr<llvm::TargetMachine>
+createTargetMachine(llvm::orc::JITTargetMachineBuilder &builder,
+                    llvm::Module &llvmModule) {
+  auto targetMachine = builder.createTargetMachine();
+  if (!targetMachine) {
+    llvm::errs() << "Failed to create the target machine: "
+                 << llvm::toString(targetMachine.takeError()) << "\n";
+    return nullptr;
+  }
+  llvmModule.setDataLayout((*targetMachine)->createDataLayout());
+  llvmModule.setTargetTriple((*targetMachine)->getTargetTriple().str());
+  return std::move(*targetMachine);
+}
 
-static cl::opt<bool> enableOpt("opt", cl::desc("Enable optimizations"));
+/// Returns the number of f64 elements fitting in a SIMD register of the
+/// target.
+static unsigned getTargetVectorWidth() {
+  llvm::InitializeNativeTarget();
+  auto builder = getTargetMachineBuilder();
+  if (!builder) {
+    llvm::consumeError(builder.takeError());
+    return 2;
+  }
+
+  // The subtarget knows the features implied by the CPU as well as the ones
+  // given explicitly.
+  if (builder->getTargetTriple().isX86()) {
+    auto targetMachine = builder->createTargetMachine();
+    if (!targetMachine) {
+      llvm::consumeError(targetMachine.takeError());
+      return 2;
+    }
+    const llvm::MCSubtargetInfo *subtarget =
+        (*targetMachine)->getMCSubtargetInfo();
+    if (subtarget->checkFeatures("+avx512f"))
+      return 8;
+    if (subtarget->checkFeatures("+avx"))
+      return 4;
+  }
+  // Every other target of interest (SSE2, NEON) has 128-bit vectors.
+  return 2;
+}
 
 /// Returns a Pony AST resulting from parsing the file or a nullptr on error.
 std::unique_ptr<pony::ModuleAST> parseInputFile(llvm::StringRef filename) {
@@ -134,25 +400,66 @@ int loadAndProcessMLIR(mlir::MLIRContext &context,
   // Apply any generic pass manager command line options and run the pipeline.
   applyPassManagerCLOptions(pm);
 
+  // A textual pipeline replaces the one of the optimization level.
+  if (!passPipeline.empty()) {
+    if (mlir::failed(mlir::parsePassPipeline(passPipeline, pm)) ||
+        mlir::failed(pm.run(*module)))
+      return 4;
+    return 0;
+  }
+
   // Check to see what granularity of MLIR we are compiling to.
   bool isLoweringToAffine = emitAction >= Action::DumpMLIRAffine;
   bool isLoweringToLLVM = emitAction >= Action::DumpMLIRLLVM;
+  unsigned optLevel = getOptLevel();
 
-  if (enableOpt || isLoweringToAffine) {
-    // Inline all functions into main and then delete them.
-    pm.addPass(mlir::createInlinerPass());
+  if (optLevel > 0 || isLoweringToAffine) {
+    // Specialize the generic functions for the shapes they are called with.
+    pm.addPass(mlir::pony::createFunctionSpecializationPass());
+
+    // Inline the specialized functions into their callers, unless they should
+    // be kept out of line. The inliner doesn't canonicalize the functions it
+    // visits, as the matrix chains must be reassociated first.
+    if (!disableInlining) {
+      pm.addPass(mlir::pony::createInlineCostModelPass(inlineThreshold));
+      pm.addPass(mlir::createInlinerPass(llvm::StringMap<mlir::OpPassManager>(),
+                                         [](mlir::OpPassManager &) {}));
+    }
 
-    // Now that there is only one function, we can infer the shapes of each of
-    // the operations.
+    // Delete the functions that are no longer referenced.
+    pm.addPass(mlir::createSymbolDCEPass());
+
+    // Now that every function is specialized, we can infer the shapes of each
+    // of the operations.
     mlir::OpPassManager &optPM = pm.nest<mlir::pony::FuncOp>();
     optPM.addPass(mlir::pony::createShapeInferencePass());
+
+    // Reassociate the chains of matrix products, before any canonicalization
+    // folds transposes and elementwise operations into them: the products with
+    // transposed operands or an epilogue end the chains.
+    optPM.addPass(mlir::pony::createMatrixChainReorderingPass());
     optPM.addPass(mlir::createCanonicalizerPass());
     optPM.addPass(mlir::createCSEPass());
+
+    // Compute the trees of elementwise operations in a single loop nest,
+    // once the canonicalization has fused what it could into the GEMMs.
+    if (optLevel >= 2)
+      optPM.addPass(mlir::pony::createElementwiseFusionPass());
   }
 
   if (isLoweringToAffine) {
     // Partially lower the pony dialect.
-    pm.addPass(mlir::pony::createLowerToAffinePass());
+    mlir::pony::AffineLoweringOptions loweringOptions;
+    loweringOptions.gemmL1TileSize = gemmL1TileSize;
+    loweringOptions.gemmL2TileSize = gemmL2TileSize;
+    loweringOptions.vectorize = enableVectorization;
+    loweringOptions.vectorWidth =
+        vectorWidth ? unsigned(vectorWidth) : getTargetVectorWidth();
+    loweringOptions.numThreads = getNumThreads();
+    loweringOptions.parallelGrainSize = parallelGrainSize;
+    loweringOptions.inPlace = !disableInPlace;
+    loweringOptions.stackAllocThreshold = stackAllocThreshold;
+    pm.addPass(mlir::pony::createLowerToAffinePass(loweringOptions));
 
     // Add a few cleanups post lowering.
     mlir::OpPassManager &optPM = pm.nest<mlir::FuncOp>();
@@ -160,15 +467,54 @@ int loadAndProcessMLIR(mlir::MLIRContext &context,
     optPM.addPass(mlir::createCSEPass());
 
     // Add optimizations if enabled.
-    if (enableOpt) {
+    if (optLevel >= 2) {
+      optPM.addPass(mlir::pony::createHorizontalFusionPass());
       optPM.addPass(mlir::createLoopFusionPass());
+    }
+    if (optLevel >= 1)
       optPM.addPass(mlir::createAffineScalarReplacementPass());
+
+    // Tile the fused nests for the cache, then vectorize and unroll-and-jam
+    // their inner loops. Only the scalar nests of contiguous buffers are
+    // vectorized, see AffineVectorization.cpp.
+    if (optLevel >= 3) {
+      optPM.addPass(mlir::createAffineLoopInvariantCodeMotionPass());
+      optPM.addPass(
+          mlir::createLoopTilingPass(uint64_t(tilingCacheSize) * 1024));
+      optPM.addPass(mlir::pony::createAffineVectorizationPass(
+          loweringOptions.vectorWidth));
+      optPM.addPass(mlir::pony::createAffineUnrollJamPass(unrollJamFactor));
+      optPM.addPass(mlir::createCanonicalizerPass());
     }
+    if (optLevel >= 2)
+      optPM.addPass(mlir::pony::createBufferPlanningPass());
+
+    // Run the independent loop nests as async tasks.
+    if (enableAsync)
+      optPM.addPass(mlir::pony::createAsyncExecutionPass());
   }
 
   if (isLoweringToLLVM) {
+    // Outline the async tasks, and manage the lifetime of their tokens.
+    if (enableAsync) {
+      pm.addPass(mlir::createAsyncToAsyncRuntimePass());
+      mlir::OpPassManager &asyncPM = pm.nest<mlir::FuncOp>();
+      asyncPM.addPass(mlir::createAsyncRuntimeRefCountingPass());
+      asyncPM.addPass(mlir::createAsyncRuntimeRefCountingOptPass());
+    }
+
+    // Run the parallel loops with the OpenMP runtime.
+    if (getNumThreads() > 1) {
+      pm.addPass(mlir::createLowerAffinePass());
+      pm.addPass(mlir::createConvertSCFToOpenMPPass());
+    }
+
+    // Lower the async tasks to calls into the async runtime.
+    if (enableAsync)
+      pm.addPass(mlir::createConvertAsyncToLLVMPass());
+
     // Finish lowering the pony IR to the LLVM dialect.
-    pm.addPass(mlir::pony::createLowerToLLVMPass());
+    pm.addPass(mlir::pony::createLowerToLLVMPass(printFormat));
   }
 
   if (mlir::failed(pm.run(*module)))
@@ -256,6 +602,7 @@ int dumpAST() {
 int dumpLLVMIR(mlir::ModuleOp module) {
   // Register the translation to LLVM IR with the MLIR context.
   mlir::registerLLVMDialectTranslation(*module->getContext());
+  mlir::registerOpenMPDialectTranslation(*module->getContext());
 
   // Convert the module to LLVM IR in a new LLVM IR context.
   llvm::LLVMContext llvmContext;
@@ -268,12 +615,20 @@ int dumpLLVMIR(mlir::ModuleOp module) {
   // Initialize LLVM targets.
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
-  mlir::ExecutionEngine::setupTargetTriple(llvmModule.get());
+  auto targetMachineBuilder = getTargetMachineBuilder();
+  if (!targetMachineBuilder) {
+    llvm::errs() << "Failed to detect the host target: "
+                 << llvm::toString(targetMachineBuilder.takeError()) << "\n";
+    return -1;
+  }
+  auto targetMachine = createTargetMachine(*targetMachineBuilder, *llvmModule);
+  if (!targetMachine)
+    return -1;
 
   /// Optionally run an optimization pipeline over the llvm module.
   auto optPipeline = mlir::makeOptimizingTransformer(
-      /*optLevel=*/enableOpt ? 3 : 0, /*sizeLevel=*/0,
-      /*targetMachine=*/nullptr);
+      /*optLevel=*/getOptLevel(), /*sizeLevel=*/0,
+      /*targetMachine=*/targetMachine.get());
   if (auto err = optPipeline(llvmModule.get())) {
     llvm::errs() << "Failed to optimize LLVM IR " << err << "\n";
     return -1;
@@ -282,6 +637,104 @@ int dumpLLVMIR(mlir::ModuleOp module) {
   return 0;
 }
 
+/// Returns the addresses of the Pony runtime functions linked in the compiler.
+static llvm::orc::SymbolMap
+getRuntimeSymbols(llvm::orc::MangleAndInterner interner) {
+  llvm::orc::SymbolMap symbolMap;
+  symbolMap[interner("_mlir_ciface_ponyPrintMemrefF64")] =
+      llvm::JITEvaluatedSymbol::fromPointer(_mlir_ciface_ponyPrintMemrefF64);
+  symbolMap[interner("_mlir_ciface_ponyPrintMemrefBinaryF64")] =
+      llvm::JITEvaluatedSymbol::fromPointer(
+          _mlir_ciface_ponyPrintMemrefBinaryF64);
+  return symbolMap;
+}
+
+namespace {
+/// An object cache keeping the machine code of the JIT-compiled modules in a
+/// directory, in files named after the identifier of their module.
+class PersistentObjectCache : public llvm::ObjectCache {
+public:
+  explicit PersistentObjectCache(llvm::StringRef dir) : dir(dir) {}
+
+  /// Returns the object cached under `key`, or nullptr if there is none.
+  std::unique_ptr<llvm::MemoryBuffer> load(llvm::StringRef key) const {
+    auto object = llvm::MemoryBuffer::getFile(getPath(key), /*IsText=*/false,
+                                              /*RequiresNullTerminator=*/false);
+    if (!object)
+      return nullptr;
+    return std::move(*object);
+  }
+
+  void notifyObjectCompiled(const llvm::Module *module,
+                            llvm::MemoryBufferRef object) override {
+    if (std::error_code ec = llvm::sys::fs::create_directories(dir)) {
+      llvm::errs() << "Could not create the JIT cache directory: "
+                   << ec.message() << "\n";
+      return;
+    }
+
+    // Write a temporary file renamed once complete, so that concurrent
+    // compilers never read a partial object.
+    std::string path = getPath(module->getModuleIdentifier());
+    int fd;
+    llvm::SmallString<128> tempPath;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, tempPath))
+      return;
+    {
+      llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+      os << object.getBuffer();
+    }
+    if (llvm::sys::fs::rename(tempPath, path))
+      llvm::sys::fs::remove(tempPath);
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *module) override {
+    return load(module->getModuleIdentifier());
+  }
+
+private:
+  std::string getPath(llvm::StringRef key) const {
+    llvm::SmallString<128> path(dir);
+    llvm::sys::path::append(path, key + ".o");
+    return std::string(path);
+  }
+
+  std::string dir;
+};
+} // namespace
+
+/// Returns the directory of the JIT cache.
+static std::string getJitCacheDir() {
+  if (!jitCacheDir.empty())
+    return jitCacheDir;
+  llvm::SmallString<128> dir;
+  if (!llvm::sys::path::cache_directory(dir))
+    llvm::sys::path::system_temp_directory(/*ErasedOnReboot=*/false, dir);
+  llvm::sys::path::append(dir, "ponyc");
+  return std::string(dir);
+}
+
+/// Returns the key of the machine code of `llvmModule` in the JIT cache: a
+/// hash of the module, of the optimization level and of the target.
+static std::string
+getJitCacheKey(llvm::Module &llvmModule,
+               llvm::orc::JITTargetMachineBuilder &targetMachineBuilder) {
+  std::string text;
+  llvm::raw_string_ostream os(text);
+  llvmModule.print(os, /*AAW=*/nullptr);
+  os << "\nllvm: " << LLVM_VERSION_STRING << "\nopt: " << getOptLevel()
+     << "\ncpu: " << targetMachineBuilder.getCPU()
+     << "\nfeatures: " << targetMachineBuilder.getFeatures().getString();
+  return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(os.str())),
+                     /*LowerCase=*/true);
+}
+
+/// The hooks of the libraries loaded in the JIT registering their symbols and
+/// releasing their resources.
+using LibraryInitFn = void (*)(llvm::StringMap<void *> &);
+using LibraryDestroyFn = void (*)();
+
 int runJit(mlir::ModuleOp module) {
   // Initialize LLVM targets.
   llvm::InitializeNativeTarget();
@@ -290,35 +743,289 @@ int runJit(mlir::ModuleOp module) {
   // Register the translation from MLIR to LLVM IR, which must happen before we
   // can JIT-compile.
   mlir::registerLLVMDialectTranslation(*module->getContext());
+  mlir::registerOpenMPDialectTranslation(*module->getContext());
 
-  // An optimization pipeline to use within the execution engine.
-  auto optPipeline = mlir::makeOptimizingTransformer(
-      /*optLevel=*/enableOpt ? 3 : 0, /*sizeLevel=*/0,
-      /*targetMachine=*/nullptr);
+  // The OpenMP runtime sizes its thread pool from the environment.
+  if (getNumThreads() > 1)
+    setenv("OMP_NUM_THREADS", std::to_string(getNumThreads()).c_str(),
+           /*overwrite=*/1);
 
-  // Create an MLIR execution engine. The execution engine eagerly JIT-compiles
-  // the module.
-  mlir::ExecutionEngineOptions engineOptions;
-  engineOptions.transformer = optPipeline;
-  auto maybeEngine = mlir::ExecutionEngine::create(module, engineOptions);
-  assert(maybeEngine && "failed to construct an execution engine");
-  auto &engine = maybeEngine.get();
+  auto llvmContext = std::make_unique<llvm::LLVMContext>();
+  auto llvmModule = mlir::translateModuleToLLVMIR(module, *llvmContext);
+  if (!llvmModule) {
+    llvm::errs() << "Failed to emit LLVM IR\n";
+    return -1;
+  }
+
+  // Compile for the CPU selected with -mcpu and -mattr. The JIT is set up as
+  // the MLIR execution engine does, except that the execution engine always
+  // targets the host and has no persistent cache.
+  auto targetMachineBuilder = getTargetMachineBuilder();
+  if (!targetMachineBuilder) {
+    llvm::errs() << "Failed to detect the host target: "
+                 << llvm::toString(targetMachineBuilder.takeError()) << "\n";
+    return -1;
+  }
+  auto targetMachine = createTargetMachine(*targetMachineBuilder, *llvmModule);
+  if (!targetMachine)
+    return -1;
+
+  // With the JIT cache, the module is named after its key, which the cache
+  // files its object under. A cached object is loaded right away and added to
+  // the JIT instead of the module, so that the module is always optimized
+  // when it is compiled.
+  std::unique_ptr<PersistentObjectCache> cache;
+  std::unique_ptr<llvm::MemoryBuffer> cachedObject;
+  if (enableJitCache) {
+    cache = std::make_unique<PersistentObjectCache>(getJitCacheDir());
+    std::string key = getJitCacheKey(*llvmModule, *targetMachineBuilder);
+    llvmModule->setModuleIdentifier(key);
+    cachedObject = cache->load(key);
+  }
+  if (!cachedObject) {
+    auto optPipeline = mlir::makeOptimizingTransformer(
+        /*optLevel=*/getOptLevel(), /*sizeLevel=*/0,
+        /*targetMachine=*/targetMachine.get());
+    if (auto err = optPipeline(llvmModule.get())) {
+      llvm::errs() << "Failed to optimize LLVM IR " << err << "\n";
+      return -1;
+    }
+  }
+
+  auto jit =
+      llvm::orc::LLJITBuilder()
+          .setJITTargetMachineBuilder(*targetMachineBuilder)
+          .setCompileFunctionCreator(
+              [&](llvm::orc::JITTargetMachineBuilder builder)
+                  -> llvm::Expected<
+                      std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                auto targetMachine = builder.createTargetMachine();
+                if (!targetMachine)
+                  return targetMachine.takeError();
+                return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(
+                    std::move(*targetMachine), cache.get());
+              })
+          .create();
+  if (!jit) {
+    llvm::errs() << "Failed to create the JIT: "
+                 << llvm::toString(jit.takeError()) << "\n";
+    return -1;
+  }
+
+  // Resolve the symbols of the process, e.g. of libc, of the libraries given
+  // with -shared-libs and of the Pony runtime.
+  llvm::orc::JITDylib &mainDylib = (*jit)->getMainJITDylib();
+  const llvm::DataLayout &dataLayout = llvmModule->getDataLayout();
+  char globalPrefix = dataLayout.getGlobalPrefix();
+  mainDylib.addGenerator(llvm::cantFail(
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          globalPrefix)));
+
+  // As in the MLIR execution engine, the libraries with init and destroy hooks,
+  // e.g. the async runtime, export their symbols through the init hook instead
+  // of making them visible.
+  llvm::StringMap<void *> exportedSymbols;
+  llvm::SmallVector<LibraryDestroyFn, 2> destroyFns;
+  auto destroyLibraries = llvm::make_scope_exit([&] {
+    for (LibraryDestroyFn destroyFn : destroyFns)
+      destroyFn();
+  });
+  for (const std::string &lib : sharedLibs) {
+    std::string errorMessage;
+    auto library = llvm::sys::DynamicLibrary::getPermanentLibrary(
+        lib.c_str(), &errorMessage);
+    if (!library.isValid()) {
+      llvm::errs() << "Failed to load '" << lib << "': " << errorMessage
+                   << "\n";
+      return -1;
+    }
+
+    void *initFn = library.getAddressOfSymbol("__mlir_execution_engine_init");
+    void *destroyFn =
+        library.getAddressOfSymbol("__mlir_execution_engine_destroy");
+    if (!initFn || !destroyFn) {
+      initFn = library.getAddressOfSymbol("__mlir_runner_init");
+      destroyFn = library.getAddressOfSymbol("__mlir_runner_destroy");
+    }
+    if (!initFn || !destroyFn) {
+      mainDylib.addGenerator(
+          std::make_unique<llvm::orc::DynamicLibrarySearchGenerator>(
+              library, globalPrefix));
+      continue;
+    }
+    reinterpret_cast<LibraryInitFn>(initFn)(exportedSymbols);
+    destroyFns.push_back(reinterpret_cast<LibraryDestroyFn>(destroyFn));
+  }
+
+  llvm::orc::MangleAndInterner interner(mainDylib.getExecutionSession(),
+                                        dataLayout);
+  llvm::orc::SymbolMap symbolMap = getRuntimeSymbols(interner);
+  for (auto &exportedSymbol : exportedSymbols)
+    symbolMap[interner(exportedSymbol.getKey())] =
+        llvm::JITEvaluatedSymbol::fromPointer(exportedSymbol.getValue());
+  llvm::cantFail(mainDylib.define(llvm::orc::absoluteSymbols(symbolMap)));
+
+  llvm::Error error =
+      cachedObject ? (*jit)->addObjectFile(std::move(cachedObject))
+                   : (*jit)->addIRModule(llvm::orc::ThreadSafeModule(
+                         std::move(llvmModule), std::move(llvmContext)));
+  if (error) {
+    llvm::errs() << "Failed to add the module to the JIT: "
+                 << llvm::toString(std::move(error)) << "\n";
+    return -1;
+  }
+  auto mainSymbol = (*jit)->lookup("main");
+  if (!mainSymbol) {
+    llvm::errs() << "JIT invocation failed: "
+                 << llvm::toString(mainSymbol.takeError()) << "\n";
+    return -1;
+  }
 
   // Invoke the JIT-compiled function.
-  auto invocationResult = engine->invokePacked("main");
-  if (invocationResult) {
-    llvm::errs() << "JIT invocation failed\n";
+  auto *mainFunction = reinterpret_cast<void (*)()>(mainSymbol->getAddress());
+  mainFunction();
+  return 0;
+}
+
+/// Returns the path of the object file or shared library to emit, named after
+/// the input file unless specified.
+static std::string getOutputFilename() {
+  if (!outputFilename.empty())
+    return outputFilename;
+  llvm::StringRef stem = inputFilename == "-"
+                             ? llvm::StringRef("a")
+                             : llvm::sys::path::stem(inputFilename);
+  return (stem + (emitAction == Action::EmitShared ? ".so" : ".o")).str();
+}
+
+/// Returns the directory of the Pony runtime library, which is built next to
+/// the compiler unless specified.
+static std::string getRuntimeLibDir(const char *argv0) {
+  if (!runtimeLibDir.empty())
+    return runtimeLibDir;
+  static int anchor;
+  std::string compiler = llvm::sys::fs::getMainExecutable(argv0, &anchor);
+  llvm::SmallString<128> dir(llvm::sys::path::parent_path(
+      llvm::sys::path::parent_path(compiler)));
+  llvm::sys::path::append(dir, "lib");
+  return std::string(dir);
+}
+
+/// Writes the native code of the module to `path`.
+static int writeObjectFile(llvm::Module &llvmModule,
+                           llvm::TargetMachine &targetMachine,
+                           llvm::StringRef path) {
+  std::error_code ec;
+  llvm::ToolOutputFile output(path, ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    llvm::errs() << "Could not open output file: " << ec.message() << "\n";
     return -1;
   }
 
+  llvm::legacy::PassManager codegenPM;
+  if (targetMachine.addPassesToEmitFile(codegenPM, output.os(), nullptr,
+                                        llvm::CGFT_ObjectFile)) {
+    llvm::errs() << "The host target can't emit object files\n";
+    return -1;
+  }
+  codegenPM.run(llvmModule);
+  output.keep();
   return 0;
 }
 
+/// Links the object file at `objectPath` into a shared library, with the Pony
+/// runtime and the libraries given with -shared-libs.
+static int linkSharedLibrary(llvm::StringRef objectPath,
+                             llvm::StringRef outputPath, const char *argv0) {
+  llvm::ErrorOr<std::string> linker = llvm::sys::findProgramByName("cc");
+  if (!linker) {
+    llvm::errs() << "Could not find the 'cc' linker driver\n";
+    return -1;
+  }
+
+  std::string runtimeDir = getRuntimeLibDir(argv0);
+  std::string libDirArg = "-L" + runtimeDir;
+  std::string rpathArg = "-Wl,-rpath," + runtimeDir;
+  llvm::SmallVector<llvm::StringRef, 16> args = {
+      *linker,   "-shared", "-o",           outputPath, objectPath,
+      libDirArg, rpathArg,  "-lpony_runtime"};
+  for (const std::string &lib : sharedLibs)
+    args.push_back(lib);
+
+  std::string errorMessage;
+  if (llvm::sys::ExecuteAndWait(*linker, args, /*Env=*/llvm::None,
+                                /*Redirects=*/{}, /*SecondsToWait=*/0,
+                                /*MemoryLimit=*/0, &errorMessage) != 0) {
+    llvm::errs() << "Failed to link '" << outputPath << "'";
+    if (!errorMessage.empty())
+      llvm::errs() << ": " << errorMessage;
+    llvm::errs() << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+/// Compiles the module ahead of time for the host, into an object file or a
+/// shared library exporting `main`. The specialized functions are private.
+int emitNativeCode(mlir::ModuleOp module, const char *argv0) {
+  mlir::registerLLVMDialectTranslation(*module->getContext());
+  mlir::registerOpenMPDialectTranslation(*module->getContext());
+
+  llvm::LLVMContext llvmContext;
+  auto llvmModule = mlir::translateModuleToLLVMIR(module, llvmContext);
+  if (!llvmModule) {
+    llvm::errs() << "Failed to emit LLVM IR\n";
+    return -1;
+  }
+
+  // Target the CPU selected with -mcpu and -mattr, with position independent
+  // code so that the object can also be linked into a shared library.
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  auto targetMachineBuilder = getTargetMachineBuilder();
+  if (!targetMachineBuilder) {
+    llvm::errs() << "Failed to detect the host target: "
+                 << llvm::toString(targetMachineBuilder.takeError()) << "\n";
+    return -1;
+  }
+  targetMachineBuilder->setRelocationModel(llvm::Reloc::PIC_);
+  auto targetMachine = createTargetMachine(*targetMachineBuilder, *llvmModule);
+  if (!targetMachine)
+    return -1;
+
+  auto optPipeline = mlir::makeOptimizingTransformer(
+      /*optLevel=*/getOptLevel(), /*sizeLevel=*/0,
+      /*targetMachine=*/targetMachine.get());
+  if (auto err = optPipeline(llvmModule.get())) {
+    llvm::errs() << "Failed to optimize LLVM IR " << err << "\n";
+    return -1;
+  }
+
+  std::string outputPath = getOutputFilename();
+  if (emitAction == Action::EmitObject)
+    return writeObjectFile(*llvmModule, *targetMachine, outputPath);
+
+  // Emit a temporary object file, and link it.
+  llvm::SmallString<128> objectPath;
+  if (std::error_code ec =
+          llvm::sys::fs::createTemporaryFile("pony", "o", objectPath)) {
+    llvm::errs() << "Could not create a temporary file: " << ec.message()
+                 << "\n";
+    return -1;
+  }
+  llvm::FileRemover objectRemover(objectPath);
+  if (int error = writeObjectFile(*llvmModule, *targetMachine, objectPath))
+    return error;
+  return linkSharedLibrary(objectPath, outputPath, argv0);
+}
+
 int main(int argc, char **argv) {
   // Register any command line options.
   mlir::registerAsmPrinterCLOptions();
   mlir::registerMLIRContextCLOptions();
   mlir::registerPassManagerCLOptions();
+  mlir::registerAllPasses();
+  mlir::pony::registerPonyPasses();
 
   cl::ParseCommandLineOptions(argc, argv, "pony compiler\n");
 
@@ -350,9 +1057,11 @@ int main(int argc, char **argv) {
   if (emitAction == Action::DumpLLVMIR)
     return dumpLLVMIR(*module);
 
-  // Otherwise, we must be running the jit.
+  // Otherwise, we must be running the jit, or compiling ahead of time.
   if (emitAction == Action::RunJIT)
     return runJit(*module);
+  if (emitAction == Action::EmitObject || emitAction == Action::EmitShared)
+    return emitNativeCode(*module, argv[0]);
 
   llvm::errs() << "No action specified (parsing only?), use -emit=<action>\n";
   return -1;
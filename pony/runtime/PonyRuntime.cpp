@@ -0,0 +1,190 @@
+//===- PonyRuntime.cpp - Runtime support library of Pony programs ---------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the runtime library that compiled Pony programs call
+// into. It is linked in the compiler for the JIT, and built as a shared
+// library for the programs compiled ahead of time.
+//
+//===----------------------------------------------------------------------===//
+
+#include "pony/Runtime.h"
+
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/// Return the stream the arrays are printed to: the file named by the
+/// `PONY_PRINT_FILE` environment variable if set, the standard output
+/// otherwise.
+static FILE *getOutputStream() {
+  static FILE *stream = [] {
+    const char *path = std::getenv("PONY_PRINT_FILE");
+    if (!path || !*path)
+      return stdout;
+    FILE *file = std::fopen(path, "wb");
+    if (!file) {
+      std::fprintf(stderr, "pony: can't open '%s', printing to stdout\n",
+                   path);
+      return stdout;
+    }
+    return file;
+  }();
+  return stream;
+}
+
+namespace {
+/// An output buffer flushed to the standard output in large chunks.
+class OutputBuffer {
+public:
+  OutputBuffer() { buffer.resize(kCapacity); }
+  ~OutputBuffer() { flush(); }
+
+  /// Append the given element followed by a space, formatted as `%f ` is.
+  void appendElement(double value) {
+    reserve(kMaxElementSize);
+    char *first = buffer.data() + size;
+    char *last = buffer.data() + buffer.size();
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    // Fixed notation with a precision of 6 is correctly rounded like `%f`, and
+    // prints infinities and NaNs the same way.
+    first = std::to_chars(first, last, value, std::chars_format::fixed, 6).ptr;
+#else
+    first += std::snprintf(first, last - first, "%f", value);
+#endif
+    *first++ = ' ';
+    size = first - buffer.data();
+  }
+
+  void appendNewLine() {
+    reserve(1);
+    buffer[size++] = '\n';
+  }
+
+  void flush() {
+    if (size == 0)
+      return;
+    // The buffer exceeds the one of the stream, which then writes it directly
+    // after flushing what it holds.
+    FILE *stream = getOutputStream();
+    std::fwrite(buffer.data(), 1, size, stream);
+    std::fflush(stream);
+    size = 0;
+  }
+
+private:
+  /// Flush the buffer if it can't hold `count` more characters.
+  void reserve(size_t count) {
+    if (buffer.size() - size < count)
+      flush();
+  }
+
+  /// The longest `%f ` formatting of a double: a sign, 309 integral digits, a
+  /// point, 6 decimals and a space.
+  static constexpr size_t kMaxElementSize = 1 + 309 + 1 + 6 + 1;
+  static constexpr size_t kCapacity = 1 << 20;
+
+  std::vector<char> buffer;
+  size_t size = 0;
+};
+} // namespace
+
+namespace {
+/// The shape and elements of an array, whatever its rank.
+struct ArrayView {
+  int64_t rank;
+  const int64_t *sizes;
+  const int64_t *strides;
+  const double *data;
+};
+} // namespace
+
+/// Print the elements of `input` whose indices in the dimensions before `dim`
+/// are fixed, starting at `offset`. A newline follows every row of the inner
+/// dimensions, as in the loop nest `pony.print` used to lower to.
+static void printDimension(OutputBuffer &output, const ArrayView &input,
+                           int64_t dim, int64_t offset) {
+  if (dim == input.rank) {
+    output.appendElement(input.data[offset]);
+    return;
+  }
+  for (int64_t i = 0; i < input.sizes[dim]; ++i) {
+    printDimension(output, input, dim + 1, offset + i * input.strides[dim]);
+    if (dim != input.rank - 1)
+      output.appendNewLine();
+  }
+}
+
+/// Write the elements of `input` whose indices in the dimensions before `dim`
+/// are fixed, starting at `offset`, in row-major order. Contiguous rows are
+/// written straight from the array.
+static void writeDimension(FILE *stream, const ArrayView &input, int64_t dim,
+                           int64_t offset) {
+  if (dim == input.rank) {
+    std::fwrite(input.data + offset, sizeof(double), 1, stream);
+    return;
+  }
+  if (dim == input.rank - 1 && input.strides[dim] == 1) {
+    std::fwrite(input.data + offset, sizeof(double), input.sizes[dim], stream);
+    return;
+  }
+  for (int64_t i = 0; i < input.sizes[dim]; ++i)
+    writeDimension(stream, input, dim + 1, offset + i * input.strides[dim]);
+}
+
+/// Return true if the elements of `input` are laid out contiguously in
+/// row-major order.
+static bool isContiguous(const ArrayView &input) {
+  int64_t stride = 1;
+  for (int64_t dim = input.rank - 1; dim >= 0; --dim) {
+    if (input.sizes[dim] != 1 && input.strides[dim] != stride)
+      return false;
+    stride *= input.sizes[dim];
+  }
+  return true;
+}
+
+/// Return a view of the given memref.
+static ArrayView getArrayView(const DynamicMemRefType<double> &memRef) {
+  return {memRef.rank, memRef.sizes, memRef.strides,
+          memRef.data + memRef.offset};
+}
+
+extern "C" void
+_mlir_ciface_ponyPrintMemrefF64(UnrankedMemRefType<double> *input) {
+  OutputBuffer output;
+  printDimension(output, getArrayView(DynamicMemRefType<double>(*input)),
+                 /*dim=*/0, /*offset=*/0);
+}
+
+extern "C" void
+_mlir_ciface_ponyPrintMemrefBinaryF64(UnrankedMemRefType<double> *input) {
+  ArrayView array = getArrayView(DynamicMemRefType<double>(*input));
+  FILE *stream = getOutputStream();
+  std::fwrite(&array.rank, sizeof(int64_t), 1, stream);
+  std::fwrite(array.sizes, sizeof(int64_t), array.rank, stream);
+
+  // The elements of a contiguous array are written without any copy.
+  int64_t numElements = 1;
+  for (int64_t dim = 0; dim < array.rank; ++dim)
+    numElements *= array.sizes[dim];
+  if (isContiguous(array))
+    std::fwrite(array.data, sizeof(double), numElements, stream);
+  else
+    writeDimension(stream, array, /*dim=*/0, /*offset=*/0);
+  std::fflush(stream);
+}
+
+extern "C" void ponyPrintArrayF64(int64_t rank, const int64_t *sizes,
+                                  const double *data) {
+  std::vector<int64_t> strides(rank);
+  int64_t stride = 1;
+  for (int64_t dim = rank - 1; dim >= 0; --dim) {
+    strides[dim] = stride;
+    stride *= sizes[dim];
+  }
+  OutputBuffer output;
+  printDimension(output, {rank, sizes, strides.data(), data}, /*dim=*/0,
+                 /*offset=*/0);
+}
@@ -0,0 +1,92 @@
+//===- pony-read.cpp - Reader of the binary output of Pony programs -------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a tool reading the arrays printed by Pony programs
+// compiled with `-print-format=binary`, and printing them back in the text
+// format of `pony.print`. Every array is made of its rank and dimensions as
+// 64-bit integers, followed by its f64 elements in row-major order.
+//
+//===----------------------------------------------------------------------===//
+
+#include "pony/Runtime.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <vector>
+
+namespace cl = llvm::cl;
+
+static cl::opt<std::string> inputFilename(cl::Positional,
+                                          cl::desc("<input binary file>"),
+                                          cl::init("-"),
+                                          cl::value_desc("filename"));
+
+static cl::opt<bool> printShapes(
+    "shapes", cl::desc("Print the shape of every array before its elements"));
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "pony binary output reader\n");
+
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> fileOrErr =
+      llvm::MemoryBuffer::getFileOrSTDIN(inputFilename,
+                                         /*RequiresNullTerminator=*/false);
+  if (std::error_code ec = fileOrErr.getError()) {
+    llvm::errs() << "Could not open input file: " << ec.message() << "\n";
+    return 1;
+  }
+  llvm::StringRef buffer = fileOrErr.get()->getBuffer();
+
+  // Read the next 64-bit integer of the buffer, or return false at its end.
+  auto readInt = [&](int64_t &value) {
+    if (buffer.size() < sizeof(int64_t))
+      return false;
+    std::memcpy(&value, buffer.data(), sizeof(int64_t));
+    buffer = buffer.drop_front(sizeof(int64_t));
+    return true;
+  };
+
+  std::vector<int64_t> sizes;
+  std::vector<double> elements;
+  while (!buffer.empty()) {
+    int64_t rank;
+    if (!readInt(rank) || rank < 0 ||
+        uint64_t(rank) > buffer.size() / sizeof(int64_t)) {
+      llvm::errs() << "Invalid array header\n";
+      return 1;
+    }
+    sizes.resize(rank);
+    int64_t numElements = 1;
+    for (int64_t &size : sizes) {
+      // A product that overflows can't match the size of the buffer.
+      if (!readInt(size) || size < 0 ||
+          llvm::MulOverflow(numElements, size, numElements)) {
+        llvm::errs() << "Invalid array header\n";
+        return 1;
+      }
+    }
+    if (buffer.size() / sizeof(double) < uint64_t(numElements)) {
+      llvm::errs() << "Truncated array of " << numElements << " elements\n";
+      return 1;
+    }
+
+    elements.resize(numElements);
+    std::memcpy(elements.data(), buffer.data(), numElements * sizeof(double));
+    buffer = buffer.drop_front(numElements * sizeof(double));
+
+    if (printShapes) {
+      llvm::outs() << "shape:";
+      for (int64_t size : sizes)
+        llvm::outs() << " " << size;
+      llvm::outs() << "\n";
+      llvm::outs().flush();
+    }
+    ponyPrintArrayF64(rank, sizes.data(), elements.data());
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+//===- pony-run.cpp - Launcher of the Pony shared libraries ---------------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a minimal launcher running the Pony programs compiled
+// with `-emit=shared`: it loads the shared library and invokes its `main`
+// function, or the function without arguments nor results named on the command
+// line. It only depends on the dynamic loader, so that compiled programs start
+// without paying for MLIR or LLVM.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <dlfcn.h>
+#include <string>
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::fprintf(stderr, "usage: %s <program.so> [function]\n", argv[0]);
+    return 2;
+  }
+
+  // A path without a slash would be looked up in the library search path.
+  std::string path = argv[1];
+  if (path.find('/') == std::string::npos)
+    path = "./" + path;
+
+  void *library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    std::fprintf(stderr, "pony-run: %s\n", dlerror());
+    return 1;
+  }
+
+  const char *functionName = argc == 3 ? argv[2] : "main";
+  auto *function = reinterpret_cast<void (*)()>(dlsym(library, functionName));
+  if (!function) {
+    std::fprintf(stderr, "pony-run: no function '%s' in '%s'\n", functionName,
+                 argv[1]);
+    return 1;
+  }
+
+  function();
+  return 0;
+}